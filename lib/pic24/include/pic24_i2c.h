@@ -62,6 +62,26 @@
 #define I2C_WADDR(x) (x & 0xFE) //clear R/W bit of I2C addr
 #define I2C_RADDR(x) (x | 0x01) //set R/W bit of I2C addr
 
+#ifndef I2C_XFER_DONE
+# define I2C_XFER_DONE    0 //transaction finished and was ACKed
+# define I2C_XFER_PENDING 1 //transaction queued or on the bus
+# define I2C_XFER_NAK     2 //slave NAKed; transaction was cut short
+
+/** A prebuilt write transaction for the interrupt-driven queue. The
+ *  caller owns the structure and the data buffer, and must not touch
+ *  either until \em u8_status leaves I2C_XFER_PENDING.
+ */
+typedef struct _I2C_XFER {
+  uint8_t u8_addr;            //slave I2C address
+  uint8_t* pu8_data;          //bytes to send
+  uint16_t u16_cnt;           //number of bytes to send
+  volatile uint8_t u8_status; //I2C_XFER_DONE, _PENDING or _NAK
+  void (*pfn_done)(struct _I2C_XFER* p_xfer); //called from the ISR when finished, may be NULL
+  void* pv_arg;               //free for use by pfn_done
+  struct _I2C_XFER* p_next;   //queue link, managed by the driver
+} I2C_XFER;
+#endif
+
 
 //I2C Operations
 void configI2C1(uint16_t u16_FkHZ);
@@ -80,6 +100,12 @@ void read1I2C1(uint8_t u8_addr,uint8_t* pu8_d1);
 void read2I2C1(uint8_t u8_addr,uint8_t* pu8_d1, uint8_t* pu8_d2);
 void readNI2C1(uint8_t u8_addr,uint8_t* pu8_data, uint16_t u16_cnt);
 
+#ifdef I2C1_INTERRUPT
+//Interrupt-driven I2C Transactions
+void queueI2C1(I2C_XFER* p_xfer);
+uint8_t isIdleI2C1(void);
+#endif
+
 #endif // #if (NUM_I2C_MODS >= 1)
 
 
@@ -168,6 +194,12 @@ void read1I2C2(uint8_t u8_addr,uint8_t* pu8_d1);
 void read2I2C2(uint8_t u8_addr,uint8_t* pu8_d1, uint8_t* pu8_d2);
 void readNI2C2(uint8_t u8_addr,uint8_t* pu8_data, uint16_t u16_cnt);
 
+#ifdef I2C2_INTERRUPT
+//Interrupt-driven I2C Transactions
+void queueI2C2(I2C_XFER* p_xfer);
+uint8_t isIdleI2C2(void);
+#endif
+
 #endif // #if (NUM_I2C_MODS >= 2)
 
 
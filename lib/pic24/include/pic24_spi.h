@@ -107,9 +107,11 @@ specified in the MPLAB C30/src/peripheral_24F/spi.h header.
 // Only include if this UART exists.
 #if (NUM_SPI_MODS >= 1)
 uint16_t ioMasterSPI1(uint16_t u16_c);
+void writeNSPI1(uint8_t* pu8_data, uint16_t u16_cnt);
 #endif
 
 
 #if (NUM_SPI_MODS >= 2)
 uint16_t ioMasterSPI2(uint16_t u16_c);
+void writeNSPI2(uint8_t* pu8_data, uint16_t u16_cnt);
 #endif
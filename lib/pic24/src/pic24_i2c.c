@@ -41,9 +41,103 @@
 // will only see it once.
 /** \file
  *  I2C support functions. \see pic24_i2c.h for details.
+ *  \par Interrupt-driven transactions
+ *  By default, all I2C functions poll the module.
+ *  Define the macro I2Cx_INTERRUPT (i.e., I2C1_INTERRUPT) in your project file to add queueI2Cx(), which
+ *  runs prebuilt write transactions from the MI2Cx interrupt and returns immediately.
+ *  Macro I2Cx_INTERRUPT_PRIORITY sets the priority (default 1).
+ *  The polled functions wait for the queue to drain before using the bus, so both may be mixed,
+ *  but not from an ISR of higher priority than the I2C interrupt.
+ *  \par DMA
+ *  There is no DMA feed. The DMA controller of these parts has no I2C request source (see the
+ *  DMA_IRQ_xxx list in pic24_dma.h), so each byte is moved by the MI2Cx interrupt.
  */
 
 
+#ifdef I2C1_INTERRUPT
+# ifndef I2C1_INTERRUPT_PRIORITY
+#   define I2C1_INTERRUPT_PRIORITY 1
+# endif
+
+# ifndef I2C_STATE_IDLE
+#   define I2C_STATE_IDLE  0
+#   define I2C_STATE_START 1
+#   define I2C_STATE_DATA  2
+#   define I2C_STATE_STOP  3
+# endif
+
+static I2C_XFER* volatile p_i2c1Head = NULL;  //transaction on the bus
+static I2C_XFER* volatile p_i2c1Tail = NULL;
+static volatile uint16_t u16_i2c1Index;
+static volatile uint8_t u8_i2c1State = I2C_STATE_IDLE;
+
+/**
+Add transaction \em p_xfer to the I2C1 queue and return immediately. The transaction starts as soon as
+those ahead of it finish; \em p_xfer->u8_status leaves I2C_XFER_PENDING when it is done.
+\param p_xfer Transaction to queue; it and its buffer must stay valid until done
+*/
+void queueI2C1(I2C_XFER* p_xfer) {
+  p_xfer->u8_status = I2C_XFER_PENDING;
+  p_xfer->p_next = NULL;
+  _MI2C1IE = 0;   //keep the ISR off the queue while linking
+  if (p_i2c1Tail == NULL) {
+    p_i2c1Head = p_xfer;
+    u8_i2c1State = I2C_STATE_START;
+    I2C1CONbits.SEN = 1;
+  } else {
+    p_i2c1Tail->p_next = p_xfer;
+  }
+  p_i2c1Tail = p_xfer;
+  _MI2C1IE = 1;
+}
+
+/**
+Return true if no queued transaction is pending on I2C1.
+*/
+uint8_t isIdleI2C1(void) {
+  return (p_i2c1Head == NULL);
+}
+
+void _ISR _MI2C1Interrupt(void) {
+  I2C_XFER* p_xfer = p_i2c1Head;
+
+  _MI2C1IF = 0;
+  switch (u8_i2c1State) {
+    case I2C_STATE_START:     //start done, send the address
+      u16_i2c1Index = 0;
+      u8_i2c1State = I2C_STATE_DATA;
+      I2C1TRN = I2C_WADDR(p_xfer->u8_addr);
+      break;
+    case I2C_STATE_DATA:      //previous byte and its ACK done
+      if (I2C1STATbits.ACKSTAT != I2C_ACK) {
+        p_xfer->u8_status = I2C_XFER_NAK;
+        u8_i2c1State = I2C_STATE_STOP;
+        I2C1CONbits.PEN = 1;
+      } else if (u16_i2c1Index < p_xfer->u16_cnt) {
+        I2C1TRN = p_xfer->pu8_data[u16_i2c1Index++];
+      } else {
+        u8_i2c1State = I2C_STATE_STOP;
+        I2C1CONbits.PEN = 1;
+      }
+      break;
+    case I2C_STATE_STOP:      //stop done, retire and start the next one
+      p_i2c1Head = p_xfer->p_next;
+      if (p_i2c1Head == NULL) p_i2c1Tail = NULL;
+      if (p_xfer->u8_status == I2C_XFER_PENDING) p_xfer->u8_status = I2C_XFER_DONE;
+      if (p_xfer->pfn_done != NULL) p_xfer->pfn_done(p_xfer);
+      if (p_i2c1Head != NULL) {
+        u8_i2c1State = I2C_STATE_START;
+        I2C1CONbits.SEN = 1;
+      } else {
+        u8_i2c1State = I2C_STATE_IDLE;
+      }
+      break;
+    default:                  //events from the polled functions
+      break;
+  }
+}
+#endif
+
 /**
 Configure and enable the I2C1 module for operation at \em u16_FkHZ kHZ clock speed.
 \param u16_FkHZ specifies clock speed in kHZ
@@ -62,6 +156,11 @@ void configI2C1(uint16_t u16_FkHZ) {
   if (u16_temp > 511)  u16_temp = 511;
   I2C1BRG = u16_temp;
   I2C1CONbits.I2CEN = 1;
+#ifdef I2C1_INTERRUPT
+  _MI2C1IF = 0;
+  _MI2C1IP = I2C1_INTERRUPT_PRIORITY;
+  _MI2C1IE = 1;
+#endif
 }
 
 /**
@@ -70,6 +169,10 @@ Operation: Perform an I2C start operation.
 void startI2C1(void) {
   uint8_t u8_wdtState;
 
+#ifdef I2C1_INTERRUPT
+  while (p_i2c1Head != NULL)  //let queued transactions finish first
+    doHeartbeat();
+#endif
   sz_lastTimeoutError = "I2C1 Start";
   u8_wdtState = _SWDTEN;  //save WDT state
   _SWDTEN = 1; //enable WDT
@@ -319,9 +422,103 @@ void readNI2C1(uint8_t u8_addr,uint8_t* pu8_data, uint16_t u16_cnt) {
 // will only see it once.
 /** \file
  *  I2C support functions. \see pic24_i2c.h for details.
+ *  \par Interrupt-driven transactions
+ *  By default, all I2C functions poll the module.
+ *  Define the macro I2Cx_INTERRUPT (i.e., I2C1_INTERRUPT) in your project file to add queueI2Cx(), which
+ *  runs prebuilt write transactions from the MI2Cx interrupt and returns immediately.
+ *  Macro I2Cx_INTERRUPT_PRIORITY sets the priority (default 1).
+ *  The polled functions wait for the queue to drain before using the bus, so both may be mixed,
+ *  but not from an ISR of higher priority than the I2C interrupt.
+ *  \par DMA
+ *  There is no DMA feed. The DMA controller of these parts has no I2C request source (see the
+ *  DMA_IRQ_xxx list in pic24_dma.h), so each byte is moved by the MI2Cx interrupt.
  */
 
 
+#ifdef I2C2_INTERRUPT
+# ifndef I2C2_INTERRUPT_PRIORITY
+#   define I2C2_INTERRUPT_PRIORITY 1
+# endif
+
+# ifndef I2C_STATE_IDLE
+#   define I2C_STATE_IDLE  0
+#   define I2C_STATE_START 1
+#   define I2C_STATE_DATA  2
+#   define I2C_STATE_STOP  3
+# endif
+
+static I2C_XFER* volatile p_i2c2Head = NULL;  //transaction on the bus
+static I2C_XFER* volatile p_i2c2Tail = NULL;
+static volatile uint16_t u16_i2c2Index;
+static volatile uint8_t u8_i2c2State = I2C_STATE_IDLE;
+
+/**
+Add transaction \em p_xfer to the I2C2 queue and return immediately. The transaction starts as soon as
+those ahead of it finish; \em p_xfer->u8_status leaves I2C_XFER_PENDING when it is done.
+\param p_xfer Transaction to queue; it and its buffer must stay valid until done
+*/
+void queueI2C2(I2C_XFER* p_xfer) {
+  p_xfer->u8_status = I2C_XFER_PENDING;
+  p_xfer->p_next = NULL;
+  _MI2C2IE = 0;   //keep the ISR off the queue while linking
+  if (p_i2c2Tail == NULL) {
+    p_i2c2Head = p_xfer;
+    u8_i2c2State = I2C_STATE_START;
+    I2C2CONbits.SEN = 1;
+  } else {
+    p_i2c2Tail->p_next = p_xfer;
+  }
+  p_i2c2Tail = p_xfer;
+  _MI2C2IE = 1;
+}
+
+/**
+Return true if no queued transaction is pending on I2C2.
+*/
+uint8_t isIdleI2C2(void) {
+  return (p_i2c2Head == NULL);
+}
+
+void _ISR _MI2C2Interrupt(void) {
+  I2C_XFER* p_xfer = p_i2c2Head;
+
+  _MI2C2IF = 0;
+  switch (u8_i2c2State) {
+    case I2C_STATE_START:     //start done, send the address
+      u16_i2c2Index = 0;
+      u8_i2c2State = I2C_STATE_DATA;
+      I2C2TRN = I2C_WADDR(p_xfer->u8_addr);
+      break;
+    case I2C_STATE_DATA:      //previous byte and its ACK done
+      if (I2C2STATbits.ACKSTAT != I2C_ACK) {
+        p_xfer->u8_status = I2C_XFER_NAK;
+        u8_i2c2State = I2C_STATE_STOP;
+        I2C2CONbits.PEN = 1;
+      } else if (u16_i2c2Index < p_xfer->u16_cnt) {
+        I2C2TRN = p_xfer->pu8_data[u16_i2c2Index++];
+      } else {
+        u8_i2c2State = I2C_STATE_STOP;
+        I2C2CONbits.PEN = 1;
+      }
+      break;
+    case I2C_STATE_STOP:      //stop done, retire and start the next one
+      p_i2c2Head = p_xfer->p_next;
+      if (p_i2c2Head == NULL) p_i2c2Tail = NULL;
+      if (p_xfer->u8_status == I2C_XFER_PENDING) p_xfer->u8_status = I2C_XFER_DONE;
+      if (p_xfer->pfn_done != NULL) p_xfer->pfn_done(p_xfer);
+      if (p_i2c2Head != NULL) {
+        u8_i2c2State = I2C_STATE_START;
+        I2C2CONbits.SEN = 1;
+      } else {
+        u8_i2c2State = I2C_STATE_IDLE;
+      }
+      break;
+    default:                  //events from the polled functions
+      break;
+  }
+}
+#endif
+
 /**
 Configure and enable the I2C2 module for operation at \em u16_FkHZ kHZ clock speed.
 \param u16_FkHZ specifies clock speed in kHZ
@@ -340,6 +537,11 @@ void configI2C2(uint16_t u16_FkHZ) {
   if (u16_temp > 511)  u16_temp = 511;
   I2C2BRG = u16_temp;
   I2C2CONbits.I2CEN = 1;
+#ifdef I2C2_INTERRUPT
+  _MI2C2IF = 0;
+  _MI2C2IP = I2C2_INTERRUPT_PRIORITY;
+  _MI2C2IE = 1;
+#endif
 }
 
 /**
@@ -348,6 +550,10 @@ Operation: Perform an I2C start operation.
 void startI2C2(void) {
   uint8_t u8_wdtState;
 
+#ifdef I2C2_INTERRUPT
+  while (p_i2c2Head != NULL)  //let queued transactions finish first
+    doHeartbeat();
+#endif
   sz_lastTimeoutError = "I2C2 Start";
   u8_wdtState = _SWDTEN;  //save WDT state
   _SWDTEN = 1; //enable WDT
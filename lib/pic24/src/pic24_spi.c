@@ -94,6 +94,48 @@ uint16_t ioMasterSPI1(uint16_t u16_c) {
   return(SPI1BUF);
 }
 
+/**
+ * Writes \em u16_cnt bytes out of SPI1 and discards what comes back.
+ * In enhanced buffer mode the TX FIFO is kept topped up and the RX
+ * FIFO drained as words arrive, so the bus runs back to back; the
+ * function returns once the last word has been shifted out. Otherwise
+ * it falls back to ioMasterSPI1() per byte. Assumes 8-bit mode.
+ * \param pu8_data Bytes to send
+ * \param u16_cnt Number of bytes to send
+ */
+
+void writeNSPI1(uint8_t* pu8_data, uint16_t u16_cnt) {
+  uint16_t u16_tx = 0;
+  uint16_t u16_rx = 0;
+
+  checkRxErrorSPI1();
+#if defined(_SRXMPT) && defined(_SPIBEN)
+  if (SPI1CON2bits.SPIBEN) {
+    while (!SPI1STATbits.SRXMPT) { //stale words would end the count early
+      (void) SPI1BUF;
+    }
+    //every word sent brings one back, so the last one back means done
+    while (u16_rx < u16_cnt) {
+      if (u16_tx < u16_cnt && !SPI1STATbits.SPITBF) {
+        SPI1BUF = pu8_data[u16_tx++];
+      }
+      while (!SPI1STATbits.SRXMPT) { //drain RX before it can overflow
+        (void) SPI1BUF;
+        u16_rx++;
+      }
+      if (u16_tx == u16_cnt) {
+        doHeartbeat();
+      }
+    }
+    return;
+  }
+#endif
+  //legacy mode
+  for (u16_tx = 0; u16_tx < u16_cnt; u16_tx++) {
+    ioMasterSPI1(pu8_data[u16_tx]);
+  }
+}
+
 #endif // #if (NUM_SPI_MODS >= 1)
 
 
@@ -196,6 +238,48 @@ uint16_t ioMasterSPI2(uint16_t u16_c) {
   return(SPI2BUF);
 }
 
+/**
+ * Writes \em u16_cnt bytes out of SPI2 and discards what comes back.
+ * In enhanced buffer mode the TX FIFO is kept topped up and the RX
+ * FIFO drained as words arrive, so the bus runs back to back; the
+ * function returns once the last word has been shifted out. Otherwise
+ * it falls back to ioMasterSPI2() per byte. Assumes 8-bit mode.
+ * \param pu8_data Bytes to send
+ * \param u16_cnt Number of bytes to send
+ */
+
+void writeNSPI2(uint8_t* pu8_data, uint16_t u16_cnt) {
+  uint16_t u16_tx = 0;
+  uint16_t u16_rx = 0;
+
+  checkRxErrorSPI2();
+#if defined(_SRXMPT) && defined(_SPIBEN)
+  if (SPI2CON2bits.SPIBEN) {
+    while (!SPI2STATbits.SRXMPT) { //stale words would end the count early
+      (void) SPI2BUF;
+    }
+    //every word sent brings one back, so the last one back means done
+    while (u16_rx < u16_cnt) {
+      if (u16_tx < u16_cnt && !SPI2STATbits.SPITBF) {
+        SPI2BUF = pu8_data[u16_tx++];
+      }
+      while (!SPI2STATbits.SRXMPT) { //drain RX before it can overflow
+        (void) SPI2BUF;
+        u16_rx++;
+      }
+      if (u16_tx == u16_cnt) {
+        doHeartbeat();
+      }
+    }
+    return;
+  }
+#endif
+  //legacy mode
+  for (u16_tx = 0; u16_tx < u16_cnt; u16_tx++) {
+    ioMasterSPI2(pu8_data[u16_tx]);
+  }
+}
+
 #endif // #if (NUM_SPI_MODS >= 2)
 
 
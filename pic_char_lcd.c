@@ -2,6 +2,7 @@
 //#include <libpic30.h>	// __delay_us()
 #include <stdarg.h>		// va_arg
 #include <stdio.h>		// vsnprintf()
+#include <string.h>		// memcpy()
 
 // #ifdef macro to determine library to include
 //#include "lib/pic24/include/pic24_i2c.h"
@@ -19,14 +20,187 @@ typedef struct message
 	uint8_t part2;
 } message;
 
+// expander writes needed to clock one byte in 8 bit mode through an
+// MCP23017, after the register byte; LCD_4BIT_FRAME is in the header
+#define LCD_8BIT_FRAME	4
+
+#ifdef LCD_I2C_QUEUE
+// lcd.xfer slot queued last; the ring drains in order, so it finishes last
+#define XFER_NEWEST(dev)	(((dev)->xhead + LCD_XFER_SLOTS - 1) % LCD_XFER_SLOTS)
+#endif
+
+// MCP23017 registers (IOCON.BANK = 0)
+#define MCP_IODIRA		0x00
+#define MCP_IODIRB		0x01
+#define MCP_IOCON		0x0A
+#define MCP_GPIOB		0x13
+#define MCP_OLATA		0x14
+#define MCP_IOCON_SEQOP	0x20	// byte mode: pointer toggles between A and B
+
+// MCP23S08 opcode and registers
+#define S08_OPCODE		0x40	// | A1:A0 << 1 from lcd.address
+#define S08_READ		0x01
+#define S08_IODIR		0x00
+#define S08_IOCON		0x05
+#define S08_GPIO		0x09
+#define S08_OLAT		0x0A
+#define S08_IOCON_SEQOP	0x20	// pointer stays put, so bytes stream into OLAT
+#define S08_IOCON_HAEN	0x08	// decode A1:A0
+
+// control byte of lcd_st7032 controllers: Co = 0 (no more control bytes
+// follow, the rest is all data) and RS
+#define NATIVE_INSTR	0x00
+#define NATIVE_DATA		0x40
+
+// lcd_flush() cost model, in bus bit times (9 per byte incl. ACK)
+#define COST_XFER	(9 + 2 + (LCD_XFER_OVERHEAD_US * LCD_BUS_KHZ) / 1000)
+
+// expander bit of a pin; 0xFF marks a pin that isn't wired
+#define PIN_MASK(pin)	((pin) < 8 ? 0x01 << (pin) : 0x00)
+
+// DDRAM address bit 7 selects the bottom controller on LCD_DUAL modules
+#ifdef LCD_DUAL
+#define CTL_BIT(dev)	(((dev)->ctl & 0x01) << 7)
+#define CTL_MIRROR		0x02	// lcd.ctl flag: sending another's instruction
+#else
+#define CTL_BIT(dev)	0x00
+#endif
+
+// lcd_geometry.ac_cell entry of an address with no visible cell
+#define LCD_NO_CELL	0xFF
+
+/*
+ Everything LCD_FIXED can pin down is read through these, so a fixed build
+ sees constants and a normal build reads the lcd struct.
+*/
+#ifdef LCD_FIXED
+#define LCD_IFACE(dev)	((lcd_interface)LCD_FIXED_BUS)
+#define LCD_ADDR(dev)	(LCD_FIXED_ADDRESS)
+#define LCD_MCP(dev)	0
+#define LCD_NATIVE(dev)	0
+#define LCD_ROWS(dev)	(LCD_FIXED_LINES)
+#define LCD_COLS(dev)	(LCD_FIXED_COLUMNS)
+#define LCD_CELLS(dev)	(LCD_FIXED_LINES * LCD_FIXED_COLUMNS)
+#define MASK_E(dev)		(0x01 << LCD_PIN_E)
+#define MASK_V0(dev)	(0x01 << LCD_PIN_V0)
+#define MASK_RS(dev)	(0x01 << LCD_PIN_RS)
+#define MASK_RW(dev)	(0x01 << LCD_PIN_RW)
+#define NIB_OUT(dev, n)	(lcd_nib_out[n])
+#define NIB_IN(dev, b)	(PIN_IN(b, LCD_PIN_D4, 0) | PIN_IN(b, LCD_PIN_D5, 1) \
+						| PIN_IN(b, LCD_PIN_D6, 2) | PIN_IN(b, LCD_PIN_D7, 3))
+#define PIN_IN(b, pin, bit)	((((b) >> (pin)) & 0x01) << (bit))
+#define PIN_OUT(n)	((((n) & 0x01) ? 0x01 << LCD_PIN_D4 : 0)	\
+					| (((n) & 0x02) ? 0x01 << LCD_PIN_D5 : 0)	\
+					| (((n) & 0x04) ? 0x01 << LCD_PIN_D6 : 0)	\
+					| (((n) & 0x08) ? 0x01 << LCD_PIN_D7 : 0))
+static const uint8_t lcd_nib_out[16] = {
+	PIN_OUT(0),  PIN_OUT(1),  PIN_OUT(2),  PIN_OUT(3),
+	PIN_OUT(4),  PIN_OUT(5),  PIN_OUT(6),  PIN_OUT(7),
+	PIN_OUT(8),  PIN_OUT(9),  PIN_OUT(10), PIN_OUT(11),
+	PIN_OUT(12), PIN_OUT(13), PIN_OUT(14), PIN_OUT(15)
+};
+#else
+#define LCD_IFACE(dev)	((dev)->interface)
+#define LCD_ADDR(dev)	((dev)->address)
+#define LCD_MCP(dev)	((dev)->expander == lcd_mcp23017)
+#define LCD_NATIVE(dev)	((dev)->expander == lcd_st7032)
+#define LCD_ROWS(dev)	((dev)->geom.rows)
+#define LCD_COLS(dev)	((dev)->geom.cols)
+#define LCD_CELLS(dev)	((dev)->geom.cells)
+#define MASK_E(dev)		((dev)->e)
+#define MASK_V0(dev)	((dev)->v0)
+#define MASK_RS(dev)	((dev)->rs_mask)
+#define MASK_RW(dev)	((dev)->rw_mask)
+#define NIB_OUT(dev, n)	((dev)->nib_out[n])
+#define NIB_IN(dev, b)	((dev)->nib_in[b])
+#endif
+
+// expander pins the LCD bus drives; the rest keep their level in lcd.port
+#define BUS_PINS(dev)	(NIB_OUT(dev, 0x0F) | MASK_RS(dev) | MASK_RW(dev) \
+						| MASK_E(dev))
+
+#ifdef LCD_GPIO
+// LCD_GPIO_* pin names -> pic24_ports.h latch, port and direction bits
+#define GPIO_LAT(p)		GPIO_LAT_(p)
+#define GPIO_LAT_(p)	_LAT##p
+#define GPIO_PORT(p)	GPIO_PORT_(p)
+#define GPIO_PORT_(p)	_R##p
+#define GPIO_TRIS(p)	GPIO_TRIS_(p)
+#define GPIO_TRIS_(p)	_TRIS##p
+#define GPIO_CONFIG(p)	GPIO_CONFIG_(p)
+#define GPIO_CONFIG_(p)	CONFIG_R##p##_AS_DIG_OUTPUT()
+
+#ifdef LCD_GPIO_D0
+#define GPIO_NIBBLES	1
+#else
+#define GPIO_NIBBLES	2
+#endif
+
+// bus timing (ns): RS/RW setup, E pulse (covers read access and data
+// setup) and E cycle; the 3V figures unless the module runs at 5V
+#ifdef LCD_GPIO_5V
+#define GPIO_T_AS		40
+#define GPIO_T_PW		230
+#define GPIO_T_CYC		500
+#else
+#define GPIO_T_AS		60
+#define GPIO_T_PW		450
+#define GPIO_T_CYC		1000
+#endif
+// ns -> gpio_wait() loops of at least 4 cycles each, rounded up
+#define GPIO_LOOPS(ns)	((uint16_t)(((ns) * (FCY / 1000000UL) + 3999) / 4000))
+#endif
+
+// lcd.init_state steps, plus flags
+#define INIT_RESET1		0x00	// 0x30 nibble x3 once power on time is up
+#define INIT_RESET2		0x01
+#define INIT_RESET3		0x02
+#define INIT_4BIT		0x03
+#define INIT_FUNCTION	0x04
+#define INIT_DISPLAY	0x05
+#define INIT_CLEAR		0x06
+#define INIT_ENTRY		0x07
+#define INIT_DONE		0x08
+#define INIT_STEP		0x0F
+#define INIT_WARM		0x40	// controller was already set up; no clear
+#define INIT_ACTIVE		0x80	// a step is running; is_busy() must not step
+
+// flags for lcd.ac_mode
+#define AC_INC		0x01	// address counter increments after RAM access
+#define AC_CGRAM	0x02	// address counter points into CGRAM
+
 
 // timing constants
 const unsigned long lcd_setup_time1		= 15500;
 const unsigned long lcd_setup_time2		= 4500;
 const unsigned long lcd_setup_time3		= 150;
+// lcd_st7032 power on, and a quarter of the follower's settling time
+const unsigned long lcd_native_time		= 50000;
 const unsigned long lcd_enable_time1	= 1;
 const unsigned long lcd_enable_time2	= 100;
 
+// execution times (us) indexed by the highest set bit of an instruction
+static const uint16_t lcd_exec_time[8] = {
+	1520,	// clear display
+	1520,	// return home
+	37,		// entry mode set
+	37,		// display on/off
+	37,		// cursor or display shift
+	37,		// function set
+	37,		// set CGRAM address
+	37		// set DDRAM address
+};
+static const uint16_t lcd_exec_data = 37;	// read or write CGRAM/DDRAM
+
+// the above converted to LCD_TMR ticks (margin included) by config_timer()
+static uint16_t lcd_exec_ticks[8];
+static uint16_t lcd_data_ticks;
+static uint16_t lcd_setup_ticks[3];
+static uint16_t lcd_native_ticks;
+
+// LCD_TMR has counted from 0 since power on, see lcd_power_on()
+static uint8_t lcd_powered = 0;
+
 
 // ANSI escape sequence(s)
 static const char ansi_csi = 0x9b;	// control sequence introducer "ESC [""
@@ -49,52 +223,162 @@ static void read_from_ram(lcd *dev, uint8_t *data);
 
 // formatting functions
 static int		at_eof(lcd *dev);
-static int		at_eol(lcd *dev);
 static uint8_t	current_line(lcd *dev);
+static uint8_t	line_end(lcd *dev, uint8_t pos);
+static uint8_t	line_of(lcd *dev, uint8_t pos);
 static void		newline(lcd *dev);
 
+// geometry functions
+static uint8_t	geom_addr(lcd *dev, uint8_t row, uint8_t col);
+static int		geom_build(lcd *dev);
+static uint8_t	geom_cell(lcd *dev, uint8_t addr);
+static uint8_t	geom_next(lcd *dev, uint8_t addr);
+
+// framebuffer functions
+static void		fb_advance(lcd *dev);
+static int		fb_dirty(lcd *dev, uint8_t index);
+static uint8_t	fb_gap(lcd *dev);
+static uint8_t	fb_ddram_addr(lcd *dev, uint8_t index);
+static uint8_t	fb_index(lcd *dev, uint8_t addr);
+
 // helper functions
+static void	ac_step(lcd *dev, uint8_t cnt);
+static void	build_map(lcd *dev);
+static int		bus_paces(uint8_t bytes);
 static void command(lcd *dev);	// generic low-level interface to LCD
 static void command_4bit(lcd *dev);	// 4bit interface to LCD
+static void command_8bit(lcd *dev);	// 8bit interface through an MCP23017
+static void command_native(lcd *dev);	// control byte + byte, no expander
+#ifdef LCD_GPIO
+static void command_gpio(lcd *dev);	// 4 or 8bit straight from MCU pins
+#endif
+static int		config_timer(void);
+#ifdef LCD_DUAL
+static void	ctl_mirror(lcd *dev, uint8_t rs, uint8_t instr);
+static int		ctl_shared(lcd *dev, uint8_t rs, uint8_t instr);
+static void	ctl_select(lcd *dev, uint8_t ctl);
+static void	ctl_split(lcd *dev);
+static void	ctl_swap(lcd *dev);
+#endif
+#ifndef LCD_FIXED	// the map is built in otherwise
 static void	default_i2c_map(lcd *dev);
-static void	init_4bit(lcd *dev);
-static void	init_8bit(lcd *dev);
+#endif
+static uint16_t	exec_ticks(lcd *dev);
+#ifdef LCD_GPIO
+static void	gpio_bus(uint8_t data);
+# ifdef LCD_GPIO_RW
+static void	gpio_dir(uint8_t in);
+# endif
+static uint8_t	gpio_sample(void);
+static void	gpio_setup(lcd *dev);
+static void	gpio_wait(uint16_t loops);
+static uint8_t	gpio_xfer(lcd *dev, uint8_t data, uint8_t nibbles);
+#endif
+static uint8_t	ctrl_bits(lcd *dev);
+static uint8_t	encode_4bit(lcd *dev, message msg, uint8_t *buf);
+static uint8_t	encode_8bit(lcd *dev, uint8_t ctrl, uint8_t data, uint8_t *buf);
+static void	init_begin(lcd *dev, int warm);
+static int	init_driver(lcd *dev);
+static void	init_wait(lcd *dev, uint16_t ticks);
 static int	is_busy(lcd *dev);
+static int	is_configured(lcd *dev);
+#ifndef LCD_FIXED
 static int	is_map_valid(uint8_t mode, lcd_map map);
+#endif
 static void	map_message(lcd *dev, message *msg);	// for non-GPIO interfaces
+static void	mcp_setup(lcd *dev);
+static void	mcp_write(lcd *dev, uint8_t reg, uint8_t data);
+static void	native_ext(lcd *dev, int setup);
 static void	unmap_message(lcd *dev, message msg);
-static void	newline(lcd *dev);
-static void	read_4bit(lcd *dev, uint8_t *data);
+static void	read_4bit(lcd *dev, uint8_t data, uint8_t *in);
+static void	receive_byte(lcd *dev, uint8_t *data);
 static void	write_4bit(lcd *dev, uint8_t data);
 static void	reset_values(lcd *dev);	// set data, rs, and rw to 0
 static void	send_byte(lcd *dev, uint8_t data);
+static void	send_bytes(lcd *dev, uint8_t *buf, uint16_t cnt);
+static void	send_frames(lcd *dev, uint8_t *buf, uint16_t cnt);
+#ifdef LCD_I2C_QUEUE
+static int		send_queued(lcd *dev, uint8_t *buf, uint16_t cnt, uint16_t ticks,
+						void (*done)(I2C_XFER*));
+#endif
+static void	shadow_port(lcd *dev, uint8_t *buf, uint16_t cnt);
+static uint8_t	spi_io(lcd *dev, uint8_t data);
+static void	spi_send(lcd *dev, uint8_t *buf, uint16_t cnt);
+static void	spi_setup(lcd *dev);
+static void	spi_write(lcd *dev, uint8_t reg, uint8_t *buf, uint16_t cnt);
+static int	xfer_follows(lcd *dev);
+static int	xfer_pending(lcd *dev);
+#ifdef LCD_I2C_QUEUE
+static void	xfer_done(I2C_XFER *xfer);
+#endif
+static void	write_burst(lcd *dev, uint8_t *data, uint8_t cnt);
 static void	set_v0(lcd *dev, int status);
+static uint16_t	power_on_ticks(uint16_t ticks);
+static void	track_ac(lcd *dev, uint8_t rs, uint8_t instr);
 
 
 /*
  some notes on common DDRAM addressing based on display size
 
- start		end			range
+ module	mode	row 0	row 1	row 2	row 3
+ 8x1	1 line	0x00
+ 16x1	2 line	0x00-0x07 then 0x40-0x47 (split)
+ 16x2	2 line	0x00	0x40
+ 20x2	2 line	0x00	0x40
+ 40x2	2 line	0x00	0x40
+ 16x4	2 line	0x00	0x40	0x10	0x50
+ 20x4	2 line	0x00	0x40	0x14	0x54
+
+ In 1 line mode DDRAM is 0x00-0x4F; in 2 line mode it is 0x00-0x27 and
+ 0x40-0x67, and the address counter runs 0x27 -> 0x40 and 0x67 -> 0x00.
+ geom_build() turns lines x columns into an lcd_geometry once at init.
+*/
 
- 1 line
- 0x00 - 0	0x4F - 79	80
 
- 2 line
- 0x00 - 0	0x27 - 39	40
- 0x40 - 64	0x67 - 103	40
+// high level  API
 
- 4 line
- 0x00 - 0	0x13 - 19	20
- 0x40		0x53		20
- 0x14		0x27		20
- 0x54		0x67		20
+/*
+ Redirects the text API into fb, a shadow of DDRAM, until the next
+ lcd_flush() sends what changed. sent tracks what the glass shows; both
+ hold LCD_FB_SIZE bytes. Call after lcd_init() or lcd_init_start();
+ pass NULLs to detach.
 */
+void lcd_attach_fb(lcd *dev, uint8_t *fb, uint8_t *sent)
+{
+	dev->fb = NULL;
+	if(fb && sent) {
+		dev->fb_addr = lcd_current_addr(dev);
+		memset(fb, ' ', LCD_FB_SIZE);
+		dev->fb_sent = sent;
+		dev->fb_full = 1;
+		dev->frame = 0;
+		dev->fb = fb;
+	}
+}
 
-
-// high level  API
+/*
+ Everything written until the matching lcd_end_frame() stays in the back
+ buffer (fb), so the glass never shows a half drawn screen and fields
+ overwritten within the frame cost nothing. Frames nest; needs a
+ framebuffer from lcd_attach_fb().
+*/
+int lcd_begin_frame(lcd *dev)
+{
+	if(!dev->fb)
+		return -1;
+	
+	dev->frame++;
+	return 0;
+}
 
 void lcd_clear(lcd *dev)
 {
+	if(dev->fb) {
+		memset(dev->fb, ' ', LCD_FB_SIZE);
+		dev->fb_addr = 0x00;
+		return;
+	}
+	
 	while(is_busy(dev));
 	clear_display(dev);
 }
@@ -115,93 +399,271 @@ char lcd_create_char(lcd *dev, uint8_t addr, uint8_t bitmap[8])
 		write_to_ram(dev, bitmap[i]);
 	}
 	
-	// restore ddram addr
-	lcd_set_addr(dev, backup_addr);
+	// restore ddram addr; with a framebuffer only the glass needs it
+	if(dev->fb)
+		set_ddram_addr(dev, backup_addr);
+	else
+		lcd_set_addr(dev, backup_addr);
 	
 	return (char)addr;
 }
 
 uint8_t lcd_current_addr(lcd *dev)
 {
-	uint8_t pos;
-	while(is_busy(dev));
-	read_busy_addr(dev, NULL, &pos);
-	return pos;
+	// kept in software; see lcd_sync_addr() to ask the LCD
+	if(dev->fb)
+		return dev->fb_addr;
+	return dev->ac;
+}
+
+/*
+ Closes a frame; the outermost one sends the net difference between the
+ back buffer and the front buffer (fb_sent). Returns what lcd_flush() does.
+*/
+int lcd_end_frame(lcd *dev)
+{
+	if(!dev->fb || !dev->frame)
+		return -1;
+	
+	if(--dev->frame)
+		return 0;
+	return lcd_flush(dev);
+}
+
+/*
+ Sends each run of cells that differ from what the glass shows with one
+ address set, then puts the hardware cursor back where the text API left
+ it. Runs separated by few enough unchanged cells that resending them is
+ cheaper than another address set are merged. Because fb is in address
+ counter order, a run carries on across rows (0, 2, 1, 3 on 4 line
+ displays) with no address set. Does nothing inside a frame. Returns the
+ number of runs sent.
+*/
+int lcd_flush(lcd *dev)
+{
+	uint8_t i, j, h, n, start, run, gap, end;
+	uint8_t next[2] = {0, LCD_DDRAM_SIZE};	// fb index to go on from, per controller
+	uint8_t halves = dev->geom.dual ? 2 : 1;
+	uint8_t last = 1;
+	uint8_t entry = dev->config & (LCD_INC | LCD_SHIFT);
+	uint8_t max_gap = fb_gap(dev);
+	int spans = 0;
+	
+	if(!dev->fb || dev->frame || (dev->init_state & INIT_STEP) != INIT_DONE)
+		return 0;
+	
+	for(;;) {
+		// alternate controllers so one executes while the other is sent to
+		for(n=0; n<halves; n++) {
+			h = (last + 1 + n) % halves;
+			end = h ? LCD_FB_SIZE : LCD_DDRAM_SIZE;
+			while(next[h] < end && !fb_dirty(dev, next[h]))
+				next[h]++;
+			if(next[h] < end)
+				break;
+		}
+		if(n == halves)
+			break;
+		
+		last = h;
+		start = i = next[h];
+		for(;;) {
+			while(i < end && fb_dirty(dev, i))
+				i++;
+			
+			for(gap = 0; gap <= max_gap && i+gap < end
+					&& !fb_dirty(dev, i+gap); gap++);
+			if(gap > max_gap || i+gap >= end)
+				break;
+			i += gap;	// cheaper to resend the gap than to jump it
+		}
+		next[h] = i;
+		
+		if(!spans && entry != LCD_INC)	// runs are sent left to right
+			entry_mode_set(dev, 1, 0);
+		spans++;
+		
+		// the address counter runs through fb order, so one set per run
+		if(dev->ac != fb_ddram_addr(dev, start) || dev->ac_mode & AC_CGRAM)
+			set_ddram_addr(dev, fb_ddram_addr(dev, start));
+		for(j=start; j<i; j+=run) {
+			run = (i-j > LCD_MAX_BURST) ? LCD_MAX_BURST : i-j;
+			while(is_busy(dev));
+			write_burst(dev, dev->fb+j, run);
+		}
+		memcpy(dev->fb_sent+start, dev->fb+start, i-start);
+	}
+	
+	if(spans && entry != LCD_INC)
+		entry_mode_set(dev, entry & LCD_INC, entry & LCD_SHIFT);
+	if(dev->ac != dev->fb_addr || dev->ac_mode & AC_CGRAM)
+		set_ddram_addr(dev, dev->fb_addr);
+	if(dev->fb_full) {	// cells off the glass count as sent too
+		memcpy(dev->fb_sent, dev->fb, LCD_FB_SIZE);
+		dev->fb_full = 0;
+	}
+	
+	return spans;
 }
 
 void lcd_home(lcd *dev)
 {
+	if(dev->fb) {
+		dev->fb_addr = 0x00;
+		return;
+	}
+	
 	while(is_busy(dev));
     return_home(dev);
 }
 
 int lcd_init(lcd *dev)
 {
-	/*
-	documentation appears to say you can't
-	check busy till after init is complete.
-	*/
+	if(lcd_init_start(dev))
+		return -1;
 	
-	// determine size of ddram based on rows x cols
-printf("Configuring i2c expander pin map\n");
-	if(!is_map_valid(dev->config&LCD_8BIT, dev->map)) {
-printf("Setting default i2c pin map\n");
-		if(dev->interface&lcd_i2c)
-			default_i2c_map(dev);
-		// if(dev->interface & lcd_spi)
-	}
+	while(!lcd_init_step(dev));
+	return 0;
+}
+
+/*
+ lcd_init() for several displays at once. The steps are interleaved so
+ every display's reset waits overlap, taking about as long as one.
+ Returns -1 if any display's config is bad; the rest are still set up.
+*/
+int lcd_init_all(lcd *devs[], size_t cnt)
+{
+	size_t i, done;
+	int status = 0;
 	
-	// generate bitmasks for enable and backlight
-	dev->e = 0x01 << (dev->map.e - 1);
-	dev->v0 = 0x01 << (dev->map.v0 - 1);
+	for(i=0; i<cnt; i++)
+		if(lcd_init_start(devs[i]))
+			status = -1;
 	
-printf("Configuring lcd 4/8 bit mode\n");
-	if(dev->config&LCD_8BIT)
-		init_8bit(dev);
-	else
-		init_4bit(dev);
-	
-printf("Calling function_set()\n");
-	function_set(
-				dev,
-				dev->config&LCD_8BIT,
-				dev->lines,
-				dev->config&LCD_FONT_5x11
-				);
-				
-printf("Calling disp_on_off()\n");
-	disp_on_off(
-				dev,
-				dev->config&LCD_DISPLAY,
-				dev->config&LCD_CURSOR,
-				dev->config&LCD_BLINK
-				);
-			
-printf("Calling clear_display()\n");	
-	clear_display(dev);
-			
-printf("Calling entry_mode_set()\n");	
-	entry_mode_set(
-				dev,
-				dev->config&LCD_INC,
-				dev->config&LCD_NOSHIFT
-				);
-				
+	do {
+		done = 0;
+		for(i=0; i<cnt; i++)
+			done += lcd_init_step(devs[i]);
+	} while(done < cnt);
+	
+	return status;
+}
+
+/*
+ Starts initialisation without waiting for any of it; lcd_init_step() then
+ moves it along. Only writes to an attached framebuffer (lcd_attach_fb())
+ queue up until it is done, and go out with the flush at the end. Without
+ one, any call that needs the bus steps init to the end first, blocking
+ for whatever is left of the power on and reset waits.
+*/
+int lcd_init_start(lcd *dev)
+{
+	if(init_driver(dev))
+		return -1;
+	
+	init_begin(dev, 0);
 	return 0;
 }
 
-int lcd_is_addr_valid(lcd *dev, uint8_t addr)
+/*
+ Runs the next init step if the controller is ready for it and returns
+ immediately. Returns 1 once init is done, 0 while it is still going.
+*/
+int lcd_init_step(lcd *dev)
 {
-	int status = 1;
+	uint8_t step = dev->init_state & INIT_STEP;
+	message msg;
 	
-	if (	(dev->lines == 1 && addr > 0x4F)				||
-			(dev->lines == 2 && addr > 0x27 && addr < 0x40)	||
-			(dev->lines == 2 && addr > 0x67)				||
-			(dev->lines == 4 && addr > 0x27 && addr < 0x40)	||
-			(dev->lines == 4 && addr > 0x67)				)
-		status = 0;
+	if(step == INIT_DONE)
+		return 1;
+	if(dev->init_state & INIT_ACTIVE || !lcd_ready(dev))
+		return 0;
 	
-	return status;
+	dev->init_state |= INIT_ACTIVE;
+	switch(step)
+	{
+		case INIT_RESET1:
+		case INIT_RESET2:
+		case INIT_RESET3:	// start in 8 bit mode, x3 bursts
+			if(LCD_NATIVE(dev)) {	// no reset; power the glass up instead
+				if(step == INIT_RESET1)
+					native_ext(dev, 1);
+				init_wait(dev, lcd_native_ticks);
+				break;
+			}
+			if(dev->config&LCD_8BIT)
+				function_set(dev, LCD_8BIT, 0, 0);
+			else {
+				reset_values(dev);
+				dev->data = 0x30;
+				map_message(dev, &msg);
+				write_4bit(dev, msg.part1);
+			}
+			init_wait(dev, lcd_setup_ticks[step == INIT_RESET3 ? 2 : 1]);
+			break;
+			
+		case INIT_4BIT:	// aaand finally set to 4bit mode
+			if(LCD_NATIVE(dev))	// rest of the follower's 200ms
+				init_wait(dev, lcd_native_ticks);
+			else if(!(dev->config&LCD_8BIT)) {
+				reset_values(dev);
+				dev->data = 0x20;
+				map_message(dev, &msg);
+				write_4bit(dev, msg.part1);
+				init_wait(dev, lcd_data_ticks);
+			}
+			break;
+			
+		case INIT_FUNCTION:
+			function_set(
+						dev,
+						dev->config&LCD_8BIT,
+						dev->geom.two_line,
+						dev->config&LCD_FONT_5x11
+						);
+			break;
+			
+		case INIT_DISPLAY:
+			disp_on_off(
+						dev,
+						dev->config&LCD_DISPLAY,
+						dev->config&LCD_CURSOR,
+						dev->config&LCD_BLINK
+						);
+			if(dev->init_state & INIT_WARM)	// the glass keeps its contents
+				dev->init_state++;
+			break;
+			
+		case INIT_CLEAR:
+			clear_display(dev);
+			break;
+			
+		case INIT_ENTRY:
+			entry_mode_set(
+						dev,
+						dev->config&LCD_INC,
+						dev->config&LCD_SHIFT
+						);
+			break;
+	}
+	dev->init_state++;
+	dev->init_state &= ~INIT_ACTIVE;
+	
+	if((dev->init_state & INIT_STEP) != INIT_DONE)
+		return 0;
+	
+#ifdef LCD_DUAL
+	ctl_split(dev);
+#endif
+	if(dev->fb)	// send whatever was written while we were busy
+		lcd_flush(dev);
+	return 1;
+}
+
+int lcd_is_addr_valid(lcd *dev, uint8_t addr)
+{
+	// only addresses of visible cells
+	return geom_cell(dev, addr) != LCD_NO_CELL;
 }
 
 int lcd_is_backlight(lcd *dev)
@@ -226,171 +688,124 @@ int lcd_is_display(lcd *dev)
 
 int lcd_move_cursor(lcd *dev, uint8_t row, uint8_t col)
 {
-	uint8_t addr = 0x00;
-	int status = 0;
-	
-	switch(dev->lines)
-	{
-		case 1:
-			if (row != 0 || col > 0x4F)
-				status = -1;
-			
-		case 2:
-			if (col > 0x27)
-				status = -1;
-			else {
-				switch(row)
-				{
-					case 0:
-						addr = 0x00;
-						break;
-					case 1:
-						addr = 0x40;
-						break;
-					default:
-						status = -1;
-				}
-			}
-			break;
-			
-		case 4:
-			if (col > 0x13)
-				status = -1;
-			else {
-				switch(row)
-				{
-					case 0:
-						addr = 0x00;
-						break;
-					case 1:
-						addr = 0x40;
-						break;
-					case 2:
-						addr = 0x14;
-						break;
-					case 4:
-						addr = 0x54;
-						break;
-					default:
-						status = -1;
-				}
-			}
-			break;
-			
-		default:
-			status = -1;
-	}
-	
-	if (!status){
-		addr += col;
-		status = lcd_set_addr(dev, addr);
-	}
-	
-	return status;
+	if (row >= LCD_ROWS(dev) || col >= LCD_COLS(dev))
+		return -1;
+	return lcd_set_addr(dev, geom_addr(dev, row, col));
+}
+
+/*
+ Starts LCD_TMR from 0 so lcd_init() only waits out whatever is left of the
+ controller's power on time. Call as early as possible after configClock().
+*/
+void lcd_power_on(void)
+{
+	LCD_TMR_CON = LCD_TMR_CONFIG;
+	LCD_TMR_PR = 0xFFFF;
+	LCD_TMR = 0;
+	LCD_TMR_IF = 0;
+	lcd_powered = 1;
 }
 
 size_t lcd_read(lcd *dev, void *buf, size_t cnt)
 {
-	uint8_t total;
-	for(total = 0; total < cnt && at_eof(dev); total++)
-		lcd_read_byte(dev, ((uint8_t*)buf)+total);
+	size_t total = 0;
+	int last = 0;
+	
+	while(total < cnt && !last) {	// the cell at max_addr is the last read
+		last = at_eof(dev);
+		lcd_read_byte(dev, ((uint8_t*)buf)+total++);
+	}
 	return total;
 }
 
 void lcd_read_byte(lcd *dev, uint8_t *data)
 {
+	if(dev->fb) {
+		*data = dev->fb[fb_index(dev, dev->fb_addr)];
+		fb_advance(dev);
+		return;
+	}
+	
+	// the read steps the address counter like a write does; see lcd_write_byte()
+	uint8_t next = geom_next(dev, lcd_current_addr(dev));
+	
 	//int status = 0;
 	while(is_busy(dev));
 	read_from_ram(dev, data);
+	
+	if (dev->config & LCD_INC)
+		lcd_set_addr(dev, next);
 	//return status;
 }
 
-int lcd_seek(lcd *dev, int offset, int whence)	// NOT DONE; need a more elegant solution...
+/*
+ Nonzero once the last instruction has had its execution time. Time spent
+ between LCD calls counts toward it, so callers can poll this and do other
+ work instead of blocking in the next call. An idle gap longer than a full
+ timer period may cost one extra wait of at most the original duration.
+*/
+int lcd_ready(lcd *dev)
 {
-	uint8_t pos;
-	uint8_t addr = 0;
-	int status = 0;
-	int jump = 1;
+	if(xfer_pending(dev))	// the clock starts once the write lands
+		return 0;
+	
+	if(dev->busy_ticks &&
+			computeDeltaTicks(dev->busy_start, LCD_TMR, LCD_TMR_PR)
+			>= dev->busy_ticks)
+		dev->busy_ticks = 0;
+	
+	return !dev->busy_ticks;
+}
+
+/*
+ lcd_init() for an MCU reset the display was powered through (watchdog,
+ soft reset). If the controller still answers in 4 bit mode the power on
+ wait and reset sequence are skipped and the glass keeps its contents.
+ Returns 1 if it was warm, 0 if it needed a full init, -1 on bad config.
+*/
+int lcd_reinit(lcd *dev)
+{
+	int warm;
+	
+	if(init_driver(dev))
+		return -1;
+	
+	warm = is_configured(dev);
+	init_begin(dev, warm);
+	while(!lcd_init_step(dev));
+	return warm;
+}
+
+int lcd_seek(lcd *dev, int offset, int whence)
+{
+	// offsets count visible cells left to right, top to bottom, and wrap
+	uint8_t addr;
+	int pos, status;
+	int cells = LCD_CELLS(dev);
 	
 	switch(whence)	// determine starting point
 	{
 		case SEEK_SET:
 			pos = 0;
+			break;
 		case SEEK_CUR:
-			pos = lcd_current_addr(dev);
-			if (offset == 0)
-				jump = 0;
+			pos = geom_cell(dev, lcd_current_addr(dev));
+			if (pos == LCD_NO_CELL)
+				return -1;
 			break;
 		case SEEK_END:
-			pos = dev->max_addr + 1;
+			pos = cells;
 			break;
 		default:
-			status = -1;
-			jump = 0;
-	}
-	
-	if (status >= 0) {
-		if (offset > 80)	// cut down offset to make calculation easier
-			offset %= 80;
-		else while (offset < 0)
-			offset += 80;
-
-		uint8_t div, rem;	// fit the pos+offset to the DDRAM address space
-		switch(dev->lines)
-		{
-			case 1:		// 1 line mode has 1 continuous block of ram
-				addr = offset + pos;
-				if (addr > 0x4F)
-					addr -= 0x4F;
-				break;
-
-			case 2:		// 2 line mode has 2 separated blocks of ram
-				div = offset / 40;
-				rem = offset % 40;
-				if (div % 2)
-					pos = (pos <= 0x27) ? pos+0x40 : pos-0x40;
-				addr = pos + rem;
-				break;
-
-			case 4:		// 4 lines has 2, but the lines are mixed up, so treat as 4
-				div = offset / 20;
-				rem = offset % 20;
-				switch(div)
-				{
-					case 1:
-						if (pos <= 0x13)					pos += 0x40;
-						else if (pos>=0x40 && pos<=0x53)	pos -= 0x40 - 0x14;
-						else if (pos>=0x14 && pos<=0x27)	pos += 0x54 - 0x14;
-						else								pos -= 0x54;
-						break;
-					case 2:
-						if (pos <= 0x13)					pos += 0x14;
-						else if (pos>=0x40 && pos<=0x53)	pos += 0x54 - 0x40;
-						else if (pos>=0x14 && pos<=0x27)	pos -= 0x14;
-						else								pos -= 0x54 - 0x40;
-						break;
-					case 3:
-						if (pos <= 0x13)					pos += 0x54;
-						else if (pos>=0x40 && pos<=0x53)	pos -= 0x40;
-						else if (pos>=0x14 && pos<=0x27)	pos += 0x40 - 0x14;
-						else								pos -= 0x50 - 0x14;
-						break;
-				}
-				addr = pos + rem;
-				break;
-
-			default:
-				status = -1;
-				jump = 0;
-		}
-
-		if (jump) {
-			status = lcd_set_addr(dev, addr);
-			if (status == 0)
-				status = addr;
-		}
+			return -1;
 	}
 	
+	pos = (pos + offset%cells + cells) % cells;
+	addr = dev->geom.cell_addr[pos];
+	
+	status = lcd_set_addr(dev, addr);
+	if (status == 0)
+		status = addr;
 	return status;
 }
 
@@ -398,18 +813,36 @@ int lcd_set_addr(lcd *dev, uint8_t addr)
 {
 	int status = 0;
 	
-	if (lcd_is_addr_valid(dev, addr)) {
+	if (!lcd_is_addr_valid(dev, addr))
+		status = -1;
+	else if (dev->fb)
+		dev->fb_addr = addr;
+	else if (dev->ac != addr || dev->ac_mode & AC_CGRAM) {
 		while(is_busy(dev));
 		set_ddram_addr(dev, addr);
-	} else
-		status = -1;
+	}
 	
 	return status;
 }
 
-void lcd_set_backlight(lcd *dev, int status)
+/*
+ Reads the address counter back from the LCD and resyncs the driver's copy,
+ e.g. to verify it; everything else uses the copy and never reads the bus.
+*/
+uint8_t lcd_sync_addr(lcd *dev)
 {
+	uint8_t pos;
+	if(!MASK_RW(dev))	// write only; the copy is all there is
+		return dev->ac;
+	
 	while(is_busy(dev));
+	read_busy_addr(dev, NULL, &pos);
+	dev->ac = CTL_BIT(dev) | pos;
+	return dev->ac;
+}
+
+void lcd_set_backlight(lcd *dev, int status)
+{
 	if(status)
 		dev->config |= LCD_BACKLIGHT;
 	else
@@ -431,6 +864,20 @@ void lcd_set_blink(lcd *dev, int status)
 	disp_on_off(dev, display, cursor, (uint8_t)status);
 }
 
+/*
+ Software contrast, 0-63, of controllers with a native I2C interface. The
+ others are set with a trimpot and return -1.
+*/
+int lcd_set_contrast(lcd *dev, uint8_t level)
+{
+	if(!LCD_NATIVE(dev) || level > 0x3F)
+		return -1;
+	
+	dev->contrast = LCD_CONTRAST(level);
+	native_ext(dev, 0);
+	return 0;
+}
+
 void lcd_set_cursor(lcd *dev, int status)
 {
 	uint8_t blink, display;
@@ -461,16 +908,36 @@ void lcd_set_display(lcd *dev, int status)
 
 size_t lcd_write(lcd *dev, void *buf, size_t cnt)
 {
-	size_t total;
-	uint8_t data;
+	size_t total = 0;
+	uint8_t *data = (uint8_t*)buf;
+	uint8_t pos, end, run;
 	
-	for(total = 0; total < cnt; total ++) {
-		data = ((char*)buf)[total];
-		if (data == '\n')
+	while(total < cnt) {
+		if (data[total] == '\n') {
 			newline(dev);
-		else {
-			lcd_write_byte(dev, data);
+			total++;
+			continue;
+		}
+		
+		if (dev->fb || !(dev->config & LCD_INC)) {	// bursts run left to right
+			lcd_write_byte(dev, data[total++]);
+			continue;
 		}
+		
+		// stream as many characters as fit before the end of the line
+		pos = lcd_current_addr(dev);
+		end = line_end(dev, pos);
+		for (run = 0;
+				run < LCD_MAX_BURST && total+run < cnt
+				&& pos+run <= end && data[total+run] != '\n';
+				run++);
+		
+		while(is_busy(dev));
+		write_burst(dev, data+total, run);
+		total += run;
+		
+		if (pos+run > end)	// same wrap fix as lcd_write_byte()
+			lcd_set_addr(dev, geom_next(dev, end));
 	}
 	
 	return total;
@@ -478,19 +945,24 @@ size_t lcd_write(lcd *dev, void *buf, size_t cnt)
 
 void lcd_write_byte(lcd *dev, uint8_t data)
 {
-	// a fix for the fact that the DDRAM for 4 line displays go: 1, 3, 2, 4
-	int line = -1;
-	if (at_eol(dev)) {
-		line = current_line(dev) + 1;
-		if (line >= dev->lines)
-			line %= dev->lines;
+	if (dev->fb) {
+		dev->fb[fb_index(dev, dev->fb_addr)] = data;
+		fb_advance(dev);
+		return;
 	}
 	
+	/*
+	 the address counter does not follow the visible layout (4 line DDRAM
+	 goes 1, 3, 2, 4 and rows are often shorter than DDRAM lines), so
+	 move it wherever it disagrees with the next cell on the glass
+	*/
+	uint8_t next = geom_next(dev, lcd_current_addr(dev));
+	
 	while(is_busy(dev));
 	write_to_ram(dev, data);
 	
-	if (line >= 0)
-		lcd_move_cursor(dev, line, 0);
+	if (dev->config & LCD_INC)
+		lcd_set_addr(dev, next);	// no-op when already there
 }
 
 
@@ -575,6 +1047,9 @@ static void set_cgram_addr(lcd *dev, uint8_t addr)
 
 static void set_ddram_addr(lcd *dev, uint8_t addr)
 {
+#ifdef LCD_DUAL
+	ctl_select(dev, addr >> 7);
+#endif
 	reset_values(dev);
 	dev->data = 0x80 | (0x7F & addr);
 	command(dev);
@@ -588,15 +1063,15 @@ static void read_busy_addr(lcd *dev, uint8_t *busy, uint8_t *addr)
 	
 	command(dev);
 	
-	if(dev->data & 0x80)
-		*busy = 0xFF;
-	*addr = dev->data & 0x7F;
+	if(busy)
+		*busy = (dev->data & 0x80) ? 0xFF : 0x00;
+	if(addr)
+		*addr = dev->data & 0x7F;
 }
 
 static void write_to_ram(lcd *dev, uint8_t data)
 {
 	reset_values(dev);
-printf("Data:\t0x%02x\n", data);
 	dev->data = data;
 	dev->rs = 1; // data register selected
 	command(dev);
@@ -623,99 +1098,555 @@ static int at_eof(lcd *dev)
 	return output;
 }
 
-static int at_eol(lcd *dev)
+
+static uint8_t current_line(lcd *dev)
 {
-	int output = 0;
-	uint8_t pos;
-	pos = lcd_current_addr(dev);
-	
-	switch (dev->lines)
-	{
-		case 1:
-			if (pos == 0x45)
-				output = 1;
-			break;
-		case 2:
-			if (pos == 0x27 || pos == 0x67)
-				output = 1;
-			break;
-		case 4:
-			if (pos == 0x13 || pos == 0x53 || pos == 0x27 || pos == 0x67)
-				output = 1;
-			break;
-	}
-	
-	return output;
+	return line_of(dev, lcd_current_addr(dev));
 }
 
-static uint8_t current_line(lcd *dev)
+static uint8_t line_end(lcd *dev, uint8_t pos)
 {
-	uint8_t pos, line;
-	pos = lcd_current_addr(dev);
+	// last address of the contiguous run of visible cells holding pos
+	uint8_t cell = geom_cell(dev, pos);
+	uint8_t col;
 	
-	switch(dev->lines)
-	{
-		case 1:
-			line = 0;
-			break;
-			
-		case 2:
-			if (pos <= 0x27)
-				line = 0;
-			else
-				line = 1;
-			break;
-			
-		case 4:
-			if (pos <= 0x13)
-				line = 0;
-			else if (pos >= 0x40 && pos <= 0x53)
-				line = 1;
-			else if (pos >= 0x14 && pos <= 0x27)
-				line = 2;
-			else
-				line = 3;
-			break;
-			
-		default:
-			line = 0;
-	}
+	if (cell == LCD_NO_CELL)
+		return pos;
+	col = cell % LCD_COLS(dev);
+	cell -= col;
+	if (col < dev->geom.split)
+		return dev->geom.cell_addr[cell + dev->geom.split - 1];
+	return dev->geom.cell_addr[cell + LCD_COLS(dev) - 1];
+}
+
+static uint8_t line_of(lcd *dev, uint8_t pos)
+{
+	uint8_t cell = geom_cell(dev, pos);
 	
-	return line;
+	if (cell == LCD_NO_CELL)
+		return 0;
+	return cell / LCD_COLS(dev);
 }
 
 static void newline(lcd *dev)
 {
 	uint8_t line = current_line(dev) + 1;
-	if (line >= dev->lines)
-		line %= dev->lines;	
+	if (line >= LCD_ROWS(dev))
+		line = 0;
 	lcd_move_cursor(dev, line, 0);
 }
 
 
-// helper functions
+// geometry functions
 
-static void command(lcd *dev)
+static uint8_t geom_addr(lcd *dev, uint8_t row, uint8_t col)
 {
-	if(dev->config&LCD_8BIT)
-		return;
-	else
-		command_4bit(dev);
+	return dev->geom.cell_addr[row * LCD_COLS(dev) + col];
 }
 
-static void command_4bit(lcd *dev)
+static int geom_build(lcd *dev)
 {
-	message msg;
-	map_message(dev, &msg);
+	lcd_geometry *g = &dev->geom;
+	uint8_t cols = dev->columns;
+	uint8_t cell, col, addr;
+	int status = -1;
 	
-	write_4bit(dev, msg.part1);
-	read_4bit(dev, &msg.part1);
-	write_4bit(dev, msg.part2);
-	read_4bit(dev, &msg.part2);
+	g->rows = dev->lines;
+	g->cols = cols;
+	g->split = cols;
+	g->cells = dev->lines * cols;
+	g->dual = 0;
+	g->row_addr[0] = 0x00;
+	g->row_addr[1] = 0x40;
+	g->row_addr[2] = cols;			// 4 line modules continue lines 0/1
+	g->row_addr[3] = 0x40 + cols;
+	
+	switch(dev->lines)
+	{
+		case 1:
+			if (cols == 16) {	// two 8 character halves, 2 line addressed
+				g->split = 8;
+				g->two_line = 1;
+			} else
+				g->two_line = 0;
+			status = (cols && cols <= 80) ? 0 : -1;
+			break;
+			
+		case 2:
+			g->two_line = 1;
+			status = (cols && cols <= 40) ? 0 : -1;
+			break;
+			
+		case 4:
+			g->two_line = 1;
+			status = (cols && cols <= 20) ? 0 : -1;
+#ifdef LCD_DUAL
+			if (cols > 20 && cols <= 40 && dev->map.e2 < 8) {
+				g->dual = 1;	// rows 2-3 are rows 0-1 of the bottom controller
+				g->row_addr[2] = 0x80;
+				g->row_addr[3] = 0xC0;
+				status = 0;
+			}
+#endif
+			break;
+	}
+	
+	if (status)
+		return status;
+	
+	// lookup tables so every later position query is a single load
+	memset(g->ac_cell, LCD_NO_CELL, LCD_FB_SIZE);
+	for (cell = 0; cell < g->cells; cell++) {
+		col = cell % cols;
+		addr = g->row_addr[cell / cols];
+		addr += (col >= g->split) ? 0x40 + col - g->split : col;
+		g->cell_addr[cell] = addr;
+		g->ac_cell[fb_index(dev, addr)] = cell;
+	}
+	
+	return 0;
+}
+
+static uint8_t geom_cell(lcd *dev, uint8_t addr)
+{
+	// linear cell shown at DDRAM address addr, or LCD_NO_CELL
+	uint8_t index = fb_index(dev, addr);
+	
+	if (index >= LCD_FB_SIZE || (addr & 0x80 && !dev->geom.dual)
+			|| (dev->geom.two_line && (addr & 0x3F) >= LCD_DDRAM_SIZE/2))
+		return LCD_NO_CELL;
+	return dev->geom.ac_cell[index];
+}
+
+static uint8_t geom_next(lcd *dev, uint8_t addr)
+{
+	// the cell after addr on the glass, wrapping to the next row
+	uint8_t cell = geom_cell(dev, addr);
+	
+	if (cell == LCD_NO_CELL || cell+1 >= LCD_CELLS(dev))
+		return dev->geom.cell_addr[0];
+	return dev->geom.cell_addr[cell+1];
+}
+
+
+
+// framebuffer functions
+
+static void fb_advance(lcd *dev)
+{
+	// mirrors what the glass path does after a character
+	uint8_t pos = dev->fb_addr;
+	
+	if (!(dev->config & LCD_INC))
+		dev->fb_addr = fb_ddram_addr(dev,
+			(fb_index(dev, pos) + LCD_FB_SIZE - 1) % LCD_FB_SIZE);
+	else
+		dev->fb_addr = geom_next(dev, pos);
+}
+
+static int fb_dirty(lcd *dev, uint8_t index)
+{
+	// cells nobody can see only go out when a run is merged across them
+	if (dev->fb_full)
+		return dev->geom.ac_cell[index] != LCD_NO_CELL;
+	return dev->fb[index] != dev->fb_sent[index];
+}
+
+static uint8_t fb_gap(lcd *dev)
+{
+	/*
+	 Jumping a gap ends the burst, sends set_ddram_addr as its own transaction
+	 and starts a new burst: two transaction overheads plus one frame.
+	 Resending costs one frame per cell, so merge while that is cheaper.
+	*/
+	uint16_t cell = LCD_4BIT_FRAME * 9;
+	uint16_t jump = cell + 2*COST_XFER;
+	if(LCD_NATIVE(dev)) {	// a byte per cell; the jump adds control bytes
+		cell = 9;
+		jump = 3*9 + 2*COST_XFER;
+	}
+	if(LCD_IFACE(dev) & lcd_spi)	// each cell and the jump cost one write time
+		return 0;
+	return (jump - 1) / cell;
+}
+
+static uint8_t fb_ddram_addr(lcd *dev, uint8_t index)
+{
+	uint8_t ctl = 0x00;
+	
+	if (index >= LCD_DDRAM_SIZE) {	// second controller
+		index -= LCD_DDRAM_SIZE;
+		ctl = 0x80;
+	}
+	if (dev->geom.two_line && index >= LCD_DDRAM_SIZE/2)
+		return ctl | (0x40 + index - LCD_DDRAM_SIZE/2);
+	return ctl | index;
+}
+
+static uint8_t fb_index(lcd *dev, uint8_t addr)
+{
+	// fb is laid out in address counter order: 0x00-0x27 then 0x40-0x67,
+	// then the same again for a second controller (address bit 7)
+	uint8_t base = (addr & 0x80) ? LCD_DDRAM_SIZE : 0;
+	
+	addr &= 0x7F;
+	if (dev->geom.two_line && addr >= 0x40)
+		return base + addr - 0x40 + LCD_DDRAM_SIZE/2;
+	return base + addr;
+}
+
+
+// helper functions
+
+static void ac_step(lcd *dev, uint8_t cnt)
+{
+	// follows the hardware wrap: 0x27->0x40 and 0x67->0x00 with 2+ lines
+	uint8_t ctl = dev->ac & 0x80;
+	uint8_t index;
+	
+	if (dev->ac_mode & AC_CGRAM) {
+		dev->ac = ctl | ((dev->ac_mode & AC_INC ? dev->ac + cnt : dev->ac - cnt)
+					& 0x3F);
+		return;
+	}
+	
+	cnt %= LCD_DDRAM_SIZE;
+	index = fb_index(dev, dev->ac & 0x7F);
+	if (dev->ac_mode & AC_INC)
+		index = (index + cnt) % LCD_DDRAM_SIZE;
+	else
+		index = (index + LCD_DDRAM_SIZE - cnt) % LCD_DDRAM_SIZE;
+	dev->ac = ctl | fb_ddram_addr(dev, index);
+}
+
+static void command(lcd *dev)
+{
+	uint16_t ticks = exec_ticks(dev);
+	uint8_t instr = dev->data;
+	uint8_t rs = dev->rs;
+	int bf_read = dev->rw && !dev->rs;	// busy flag can be read at any time
+	
+	if(dev->rw && !MASK_RW(dev)) {	// RW tied low: nothing can be read
+		dev->data = 0x00;
+		return;
+	}
+	
+#ifdef LCD_DUAL
+	if(!dev->rw && ctl_shared(dev, rs, instr))
+		ctl_mirror(dev, rs, instr);
+#endif
+	
+	if(!bf_read)
+		while(is_busy(dev));
+	
+	dev->pend_ticks = ticks;
+#ifdef LCD_GPIO
+	if(LCD_IFACE(dev) == lcd_gpio)
+		command_gpio(dev);
+	else
+#endif
+	if(LCD_NATIVE(dev))
+		command_native(dev);
+	else if(dev->config&LCD_8BIT)	// writes start the clock in send_frames()
+		command_8bit(dev);
+	else
+		command_4bit(dev);
+	
+	if(dev->rw && !bf_read) {
+		dev->busy_start = LCD_TMR;
+		dev->busy_ticks = ticks;
+	}
+	if(!bf_read)
+		track_ac(dev, rs, instr);
+	
+#ifdef LCD_DUAL
+	// clear and home leave the cursor on the top controller
+	if(ctl_shared(dev, rs, instr) && !rs && instr < 0x04 && dev->ctl)
+		ctl_select(dev, 0);
+#endif
+}
+
+static void command_8bit(lcd *dev)
+{
+	uint8_t buf[1 + LCD_8BIT_FRAME];
+	uint8_t ctrl = ctrl_bits(dev);
+	uint8_t reg = MCP_GPIOB;
+	
+	if(!dev->rw) {
+		buf[0] = MCP_OLATA;
+		send_frames(dev, buf, 1 + encode_8bit(dev, ctrl, dev->data, buf+1));
+		return;
+	}
+	
+	// float the data port, raise RW then E, read GPB, drop E, drive again
+	mcp_write(dev, MCP_IODIRB, 0xFF);
+	buf[0] = MCP_OLATA;
+	buf[1] = ctrl;
+	buf[2] = 0xFF;	// OLATB; ignored while GPB is an input
+	buf[3] = ctrl | MASK_E(dev);
+	send_bytes(dev, buf, 4);
+	send_bytes(dev, &reg, 1);
+	receive_byte(dev, &dev->data);
+	mcp_write(dev, MCP_OLATA, ctrl);
+	mcp_write(dev, MCP_IODIRB, 0x00);
+}
+
+static void command_native(lcd *dev)
+{
+	uint8_t buf[2];
+	
+	// write only: reads never get past command()
+	buf[0] = dev->rs ? NATIVE_DATA : NATIVE_INSTR;
+	buf[1] = dev->data;
+	send_frames(dev, buf, 2);
+}
+
+static void command_4bit(lcd *dev)
+{
+	message msg;
+	map_message(dev, &msg);
+	
+	if(!dev->rw) {	// plain writes need no readback; one burst does it all
+		uint8_t buf[LCD_4BIT_FRAME];
+		send_frames(dev, buf, encode_4bit(dev, msg, buf));
+		return;
+	}
+	
+	// data lines were set high by the caller so the LCD can drive them
+	uint8_t idle = msg.part2 & ~MASK_E(dev);
+	if(LCD_IFACE(dev) & lcd_spi)	// MCP23S08 pins aren't quasi-bidirectional
+		mcp_write(dev, S08_IODIR, NIB_OUT(dev, 0x0F));
+	read_4bit(dev, msg.part1, &msg.part1);
+	read_4bit(dev, msg.part2, &msg.part2);
+	send_byte(dev, idle);	// close the last strobe
+	if(LCD_IFACE(dev) & lcd_spi)
+		mcp_write(dev, S08_IODIR, 0x00);
 	
 	unmap_message(dev, msg);
 }
 
+#ifdef LCD_GPIO
+static void command_gpio(lcd *dev)
+{
+	if(dev->rw) {
+		dev->data = gpio_xfer(dev, 0x00, GPIO_NIBBLES);
+		return;
+	}
+	
+	gpio_xfer(dev, dev->data, GPIO_NIBBLES);
+	dev->busy_start = LCD_TMR;
+	dev->busy_ticks = dev->pend_ticks;
+}
+#endif
+
+/*
+ Turns the pin map into lookup tables once, so encoding a byte is two loads
+ and an OR, and decoding a read is two loads, instead of a bit test per pin.
+ An LCD_FIXED build has them as constants and only fills in the struct.
+*/
+static void build_map(lcd *dev)
+{
+#ifdef LCD_FIXED
+	dev->interface = LCD_IFACE(dev);
+	dev->address = LCD_FIXED_ADDRESS;
+	dev->expander = lcd_pcf8574;
+	dev->lines = LCD_FIXED_LINES;
+	dev->columns = LCD_FIXED_COLUMNS;
+	dev->map.rs = LCD_PIN_RS;
+	dev->map.rw = LCD_PIN_RW;
+	dev->map.e = LCD_PIN_E;
+	dev->map.v0 = LCD_PIN_V0;
+	dev->map.d4 = LCD_PIN_D4;
+	dev->map.d5 = LCD_PIN_D5;
+	dev->map.d6 = LCD_PIN_D6;
+	dev->map.d7 = LCD_PIN_D7;
+#else
+	uint8_t pin[4];
+	uint16_t i;
+	uint8_t b;
+	
+	pin[0] = dev->map.d4;
+	pin[1] = dev->map.d5;
+	pin[2] = dev->map.d6;
+	pin[3] = dev->map.d7;
+	
+	// masks for enable, backlight and the register/direction selects
+	dev->e = PIN_MASK(dev->map.e);
+	dev->v0 = PIN_MASK(dev->map.v0);
+	dev->rs_mask = PIN_MASK(dev->map.rs);
+	dev->rw_mask = PIN_MASK(dev->map.rw);
+	if(dev->expander == lcd_74hc595 || dev->expander == lcd_st7032)	// write only
+		dev->rw_mask = 0x00;
+#ifdef LCD_GPIO
+# ifndef LCD_GPIO_RW
+	if(dev->interface == lcd_gpio)
+		dev->rw_mask = 0x00;
+# endif
+#endif
+#ifdef LCD_DUAL
+	dev->e |= PIN_MASK(dev->map.e2);	// init both controllers as one
+#endif
+	
+	for(i=0; i<16; i++) {
+		dev->nib_out[i] = 0x00;
+		for(b=0; b<4; b++)
+			if(i & (0x01 << b))
+				dev->nib_out[i] |= 0x01 << pin[b];
+	}
+	
+	for(i=0; i<256; i++) {
+		dev->nib_in[i] = 0x00;
+		for(b=0; b<4; b++)
+			if(i & (0x01 << pin[b]))
+				dev->nib_in[i] |= 0x01 << b;
+	}
+#endif
+}
+
+/*
+ Nonzero if bytes I2C byte times at LCD_BUS_KHZ outlast a data write's
+ execution time, margin included, so frames can follow with no wait.
+*/
+static int bus_paces(uint8_t bytes)
+{
+	return bytes * 9000UL / LCD_BUS_KHZ
+			>= lcd_exec_data + (lcd_exec_data * LCD_EXEC_MARGIN) / 100;
+}
+
+/*
+ Starts LCD_TMR free running if nothing else has. One that is already
+ running is shared as it is, so it has to count through 0xFFFF and tick
+ slowly enough for the longest wait, lcd_native_time, to fit in 16 bits.
+ Returns 0 on success and -1 if it doesn't.
+*/
+static int config_timer(void)
+{
+	uint16_t pre;
+	int i;
+	
+	if(!LCD_TMR_CONbits.TON) {
+		LCD_TMR_CON = LCD_TMR_CONFIG;
+		LCD_TMR_PR = 0xFFFF;
+		LCD_TMR = 0;
+	} else if(LCD_TMR_PR != 0xFFFF)
+		return -1;
+	
+	pre = getTimerPrescale(LCD_TMR_CONbits);
+	if(lcd_native_time * (FCY / 1000000UL) / pre > 0xFFFF)
+		return -1;
+	
+	// convert once here; usToU16Ticks() is float math
+	for(i=0; i<8; i++)
+		lcd_exec_ticks[i] = usToU16Ticks(lcd_exec_time[i]
+							+ (lcd_exec_time[i] * LCD_EXEC_MARGIN) / 100, pre);
+	lcd_data_ticks = usToU16Ticks(lcd_exec_data
+						+ (lcd_exec_data * LCD_EXEC_MARGIN) / 100, pre);
+	lcd_setup_ticks[0] = usToU16Ticks(lcd_setup_time1, pre);
+	lcd_setup_ticks[1] = usToU16Ticks(lcd_setup_time2, pre);
+	lcd_setup_ticks[2] = usToU16Ticks(lcd_setup_time3, pre);
+	lcd_native_ticks = usToU16Ticks(lcd_native_time, pre);
+	return 0;
+}
+
+#ifdef LCD_DUAL
+/*
+ Sends an instruction the selected controller is about to get to the other
+ one as well, so mode and CGRAM changes reach both halves of the glass. It
+ goes first and executes while the selected one is being sent to. Only the
+ selected controller shows the cursor.
+*/
+static void ctl_mirror(lcd *dev, uint8_t rs, uint8_t instr)
+{
+	uint8_t data = instr;
+	
+	if(!rs && (instr & 0xF8) == 0x08)
+		data &= ~0x03;	// cursor and blink off
+	
+	ctl_swap(dev);
+	dev->ctl |= CTL_MIRROR;
+	reset_values(dev);
+	dev->data = data;
+	dev->rs = rs;
+	command(dev);
+	dev->ctl &= ~CTL_MIRROR;
+	ctl_swap(dev);
+	
+	reset_values(dev);	// put back what the caller is sending
+	dev->data = instr;
+	dev->rs = rs;
+}
+
+static int ctl_shared(lcd *dev, uint8_t rs, uint8_t instr)
+{
+	// all but DDRAM addresses, DDRAM data and cursor moves go to both
+	if(!dev->geom.dual || dev->ctl & CTL_MIRROR
+			|| (dev->init_state & INIT_STEP) != INIT_DONE)
+		return 0;	// init raises both E at once anyway
+	if(rs)
+		return dev->ac_mode & AC_CGRAM;
+	return !(instr & 0x80) && (instr & 0xF8) != 0x10;
+}
+
+static void ctl_select(lcd *dev, uint8_t ctl)
+{
+	if(!dev->geom.dual || (dev->ctl & 0x01) == ctl)
+		return;
+	
+	ctl_swap(dev);
+	if(dev->config & (LCD_CURSOR | LCD_BLINK))	// the cursor follows
+		disp_on_off(
+					dev,
+					dev->config&LCD_DISPLAY,
+					dev->config&LCD_CURSOR,
+					dev->config&LCD_BLINK
+					);
+}
+
+static void ctl_split(lcd *dev)
+{
+	// init drove both controllers as one; from here on they are separate
+	dev->ctl = 0;
+	dev->e = PIN_MASK(dev->map.e);
+	dev->other.e = PIN_MASK(dev->map.e2);
+	dev->other.ac = 0x80 | dev->ac;
+	dev->other.ac_mode = dev->ac_mode;
+	dev->other.busy_start = dev->busy_start;
+	dev->other.busy_ticks = dev->busy_ticks;
+}
+
+static void ctl_swap(lcd *dev)
+{
+	lcd_ctl tmp;
+	
+	while(xfer_pending(dev));	// xfer_done() stamps the selected one
+	tmp = dev->other;
+	dev->other.e = dev->e;
+	dev->other.ac = dev->ac;
+	dev->other.ac_mode = dev->ac_mode;
+	dev->other.busy_start = dev->busy_start;
+	dev->other.busy_ticks = dev->busy_ticks;
+	dev->e = tmp.e;
+	dev->ac = tmp.ac;
+	dev->ac_mode = tmp.ac_mode;
+	dev->busy_start = tmp.busy_start;
+	dev->busy_ticks = tmp.busy_ticks;
+	dev->ctl ^= 0x01;
+}
+#endif
+
+static uint8_t ctrl_bits(lcd *dev)
+{
+	// RS and RW for the current dev->rs/rw, E low, backlight as latched
+	uint8_t ctrl = dev->port & ~BUS_PINS(dev);
+	
+	if(dev->rs)
+		ctrl |= MASK_RS(dev);
+	if(dev->rw)
+		ctrl |= MASK_RW(dev);
+	return ctrl;
+}
+
+#ifndef LCD_FIXED
 static void default_i2c_map(lcd *dev)
 {
 	dev->map.rs = 0;
@@ -726,163 +1657,615 @@ static void default_i2c_map(lcd *dev)
 	dev->map.d5 = 5;
 	dev->map.d6 = 6;
 	dev->map.d7 = 7;
+#ifdef LCD_DUAL
+	dev->map.e2 = 0xFF;
+#endif
 	
 	// unused in 4 data bit i2c mode
 	dev->map.d0 = 0xFF;
 	dev->map.d1 = 0xFF;
 	dev->map.d2 = 0xFF;
 	dev->map.d3 = 0xFF;
+	
+	if(LCD_MCP(dev)) {	// whole data bus on GPB
+		dev->map.d0 = 8;
+		dev->map.d1 = 9;
+		dev->map.d2 = 10;
+		dev->map.d3 = 11;
+		dev->map.d4 = 12;
+		dev->map.d5 = 13;
+		dev->map.d6 = 14;
+		dev->map.d7 = 15;
+	}
+}
+#endif
+
+/*
+ Packs one mapped byte into the expander writes that clock it into the LCD:
+ high nibble with E raised, then dropped, then the same for the low nibble.
+ The expander idles with E low, so a leading E-low write is redundant, and
+ each I2C byte time (~90us @ 100kHz) easily covers the E pulse width.
+*/
+static uint8_t encode_4bit(lcd *dev, message msg, uint8_t *buf)
+{
+	buf[0] = msg.part1 | MASK_E(dev);
+	buf[1] = msg.part1 & ~MASK_E(dev);
+	buf[2] = msg.part2 | MASK_E(dev);
+	buf[3] = msg.part2 & ~MASK_E(dev);
+	return LCD_4BIT_FRAME;
 }
 
-static void init_4bit(lcd *dev)
+/*
+ One byte through an MCP23017 in byte mode, pointer at OLATA: E up, data
+ on GPB, E down to latch it, then GPB again so the next frame starts back
+ on OLATA. ctrl is the RS/RW/backlight pattern on GPA.
+*/
+static uint8_t encode_8bit(lcd *dev, uint8_t ctrl, uint8_t data, uint8_t *buf)
 {
-	message msg;
-	reset_values(dev);
+	buf[0] = ctrl | MASK_E(dev);
+	buf[1] = data;
+	buf[2] = ctrl;
+	buf[3] = data;
+	return LCD_8BIT_FRAME;
+}
+
+static uint16_t exec_ticks(lcd *dev)
+{
+	uint8_t bit = 7;
 	
-	// start in 8 bit mode, x3 bursts
-	dev->data = 0x30;
-	map_message(dev, &msg);
-	DELAY_US(lcd_setup_time1);
+	if(dev->rs)
+		return lcd_data_ticks;
+	if(dev->rw)	// busy flag/address read executes immediately
+		return 0;
 	
-	write_4bit(dev, msg.part1);
-	DELAY_US(lcd_setup_time2);
+	while(bit && !(dev->data & (0x01 << bit)))
+		bit--;
+	return lcd_exec_ticks[bit];
+}
+
+#ifdef LCD_GPIO
+// bits 7-4 of data onto D7-D4, and in 8 bit mode bits 3-0 onto D3-D0
+static void gpio_bus(uint8_t data)
+{
+	GPIO_LAT(LCD_GPIO_D7) = (data >> 7) & 0x01;
+	GPIO_LAT(LCD_GPIO_D6) = (data >> 6) & 0x01;
+	GPIO_LAT(LCD_GPIO_D5) = (data >> 5) & 0x01;
+	GPIO_LAT(LCD_GPIO_D4) = (data >> 4) & 0x01;
+#ifdef LCD_GPIO_D0
+	GPIO_LAT(LCD_GPIO_D3) = (data >> 3) & 0x01;
+	GPIO_LAT(LCD_GPIO_D2) = (data >> 2) & 0x01;
+	GPIO_LAT(LCD_GPIO_D1) = (data >> 1) & 0x01;
+	GPIO_LAT(LCD_GPIO_D0) = data & 0x01;
+#endif
+}
+
+#ifdef LCD_GPIO_RW	// only reads turn the data pins around
+static void gpio_dir(uint8_t in)
+{
+	GPIO_TRIS(LCD_GPIO_D7) = in;
+	GPIO_TRIS(LCD_GPIO_D6) = in;
+	GPIO_TRIS(LCD_GPIO_D5) = in;
+	GPIO_TRIS(LCD_GPIO_D4) = in;
+#ifdef LCD_GPIO_D0
+	GPIO_TRIS(LCD_GPIO_D3) = in;
+	GPIO_TRIS(LCD_GPIO_D2) = in;
+	GPIO_TRIS(LCD_GPIO_D1) = in;
+	GPIO_TRIS(LCD_GPIO_D0) = in;
+#endif
+}
+#endif
+
+// the data pins, laid out as gpio_bus() takes them
+static uint8_t gpio_sample(void)
+{
+	uint8_t data;
+	data = (GPIO_PORT(LCD_GPIO_D7) << 7) | (GPIO_PORT(LCD_GPIO_D6) << 6)
+			| (GPIO_PORT(LCD_GPIO_D5) << 5) | (GPIO_PORT(LCD_GPIO_D4) << 4);
+#ifdef LCD_GPIO_D0
+	data |= (GPIO_PORT(LCD_GPIO_D3) << 3) | (GPIO_PORT(LCD_GPIO_D2) << 2)
+			| (GPIO_PORT(LCD_GPIO_D1) << 1) | GPIO_PORT(LCD_GPIO_D0);
+#endif
+	return data;
+}
+
+// everything but the backlight driven low, so E idles and writes are set up
+static void gpio_setup(lcd *dev)
+{
+	GPIO_LAT(LCD_GPIO_E) = 0;
+	GPIO_LAT(LCD_GPIO_RS) = 0;
+	GPIO_CONFIG(LCD_GPIO_E);
+	GPIO_CONFIG(LCD_GPIO_RS);
+#ifdef LCD_GPIO_RW
+	GPIO_LAT(LCD_GPIO_RW) = 0;
+	GPIO_CONFIG(LCD_GPIO_RW);
+#endif
+#ifdef LCD_GPIO_V0
+	GPIO_LAT(LCD_GPIO_V0) = (dev->config & LCD_BACKLIGHT) ? 1 : 0;
+	GPIO_CONFIG(LCD_GPIO_V0);
+#endif
+	gpio_bus(0x00);
+	GPIO_CONFIG(LCD_GPIO_D7);
+	GPIO_CONFIG(LCD_GPIO_D6);
+	GPIO_CONFIG(LCD_GPIO_D5);
+	GPIO_CONFIG(LCD_GPIO_D4);
+#ifdef LCD_GPIO_D0
+	GPIO_CONFIG(LCD_GPIO_D3);
+	GPIO_CONFIG(LCD_GPIO_D2);
+	GPIO_CONFIG(LCD_GPIO_D1);
+	GPIO_CONFIG(LCD_GPIO_D0);
+#endif
+}
+
+static void gpio_wait(uint16_t loops)
+{
+	while(loops--)
+		Nop();
+}
+
+/*
+ Clocks one byte (or, with nibbles = 1 in 4 bit mode, just its high nibble)
+ through the pins for dev->rs/rw, timed from FCY rather than bus latency.
+ Reads turn the data pins around only while the LCD drives them.
+*/
+static uint8_t gpio_xfer(lcd *dev, uint8_t data, uint8_t nibbles)
+{
+	uint8_t in = 0x00;
+	uint8_t n;
 	
-	write_4bit(dev, msg.part1);
-	DELAY_US(lcd_setup_time2);
+	GPIO_LAT(LCD_GPIO_RS) = dev->rs ? 1 : 0;
+#ifdef LCD_GPIO_RW
+	GPIO_LAT(LCD_GPIO_RW) = dev->rw ? 1 : 0;
+	if(dev->rw)
+		gpio_dir(1);
+#endif
 	
-	write_4bit(dev, msg.part1);
-	DELAY_US(lcd_setup_time3);
+	for(n=0; n<nibbles; n++) {
+		if(!dev->rw)
+			gpio_bus(n ? data << 4 : data);
+		gpio_wait(GPIO_LOOPS(GPIO_T_AS));
+		GPIO_LAT(LCD_GPIO_E) = 1;
+		gpio_wait(GPIO_LOOPS(GPIO_T_PW));
+		if(dev->rw)
+			in |= n ? gpio_sample() >> 4 : gpio_sample();
+		GPIO_LAT(LCD_GPIO_E) = 0;
+		gpio_wait(GPIO_LOOPS(GPIO_T_CYC - GPIO_T_PW - GPIO_T_AS));
+	}
 	
-	// aaand finally set to 4bit mode
-	dev->data = 0x20;
-	map_message(dev, &msg);
-	write_4bit(dev, msg.part1);
+#ifdef LCD_GPIO_RW
+	if(dev->rw) {
+		GPIO_LAT(LCD_GPIO_RW) = 0;
+		gpio_dir(0);
+	}
+#endif
+	return in;
 }
+#endif
 
-static void init_8bit(lcd *dev)
+static void init_begin(lcd *dev, int warm)
 {
-	DELAY_US(lcd_setup_time1);
-	function_set(dev, LCD_8BIT, 0, 0);
-	DELAY_US(lcd_setup_time2);
+	if(warm) {
+		dev->init_state = INIT_FUNCTION | INIT_WARM;
+		return;
+	}
+	
+	// the reset sequence can't check busy; the timer paces it instead
+	dev->init_state = INIT_RESET1;
+	init_wait(dev, power_on_ticks(LCD_NATIVE(dev) ? lcd_native_ticks
+								: lcd_setup_ticks[0]));
+}
+
+static int init_driver(lcd *dev)
+{
+#ifdef LCD_I2C_QUEUE
+	uint8_t i;
+#endif
+	/*
+	documentation appears to say you can't
+	check busy till after init is complete.
+	*/
+	dev->init_state = INIT_DONE;	// nothing to step until init_begin()
+#ifdef LCD_DUAL
+	dev->ctl = 0;
+#endif
 	
-	function_set(dev, LCD_8BIT, 0, 0);
-	DELAY_US(lcd_setup_time3);
+	// the MCP23017 only runs 8 bit mode and the PCF8574 only 4 bit
+	if(LCD_IFACE(dev) == lcd_gpio) {
+#ifdef LCD_GPIO
+		if(GPIO_NIBBLES == 1)	// the pins wired set the mode
+			dev->config |= LCD_8BIT;
+		else
+			dev->config &= ~LCD_8BIT;
+#else
+		return -1;
+#endif
+	} else if(LCD_MCP(dev) || LCD_NATIVE(dev))
+		dev->config |= LCD_8BIT;
+	else if(dev->config&LCD_8BIT)
+		return -1;
 	
-	function_set(dev, LCD_8BIT, 0, 0);
+#ifndef LCD_FIXED
+	// SPI takes a 74HC595 or MCP23S08 and a chip select, I2C the others
+	if(dev->interface&lcd_spi) {
+		if(!dev->cs || (dev->expander != lcd_74hc595
+				&& dev->expander != lcd_mcp23s08))
+			return -1;
+	} else if(dev->expander == lcd_74hc595 || dev->expander == lcd_mcp23s08)
+		return -1;
+#endif
+	
+	if(LCD_NATIVE(dev) && dev->contrast
+			&& (dev->contrast & ~0x3F) != LCD_CONTRAST_SET)
+		return -1;	// not LCD_CONTRAST(0-63)
+	
+#ifndef LCD_FIXED
+	if(LCD_NATIVE(dev) || !is_map_valid(dev->config&LCD_8BIT, dev->map)) {
+		// SPI backpacks are wired like the PCF8574 ones; GPIO only
+		// needs the masks, to know RW is there, and lcd_st7032 none
+		default_i2c_map(dev);
+	}
+#endif
+	build_map(dev);
+	// what the first write puts on the pins that aren't the bus
+	dev->port = (dev->config & LCD_BACKLIGHT) ? MASK_V0(dev) : 0x00;
+	
+	if(geom_build(dev))
+		return -1;
+#ifdef LCD_DUAL
+	if(dev->geom.dual && LCD_NATIVE(dev))	// one controller per address
+		return -1;
+#endif
+	dev->max_addr = geom_addr(dev, LCD_ROWS(dev)-1, LCD_COLS(dev)-1);
+	
+	if(config_timer())
+		return -1;
+	dev->fb = NULL;
+	dev->ac = 0x00;
+	dev->ac_mode = AC_INC;
+	dev->busy_ticks = 0;
+	dev->poll_ticks = 0;	// measured on the first poll
+#ifdef LCD_I2C_QUEUE
+	// a reinit can find frames still queued; they point into this ring
+# ifdef I2C1_INTERRUPT
+	if(LCD_IFACE(dev) == lcd_i2c1)
+		while(!isIdleI2C1())
+			doHeartbeat();
+# endif
+# ifdef I2C2_INTERRUPT
+	if(LCD_IFACE(dev) == lcd_i2c2)
+		while(!isIdleI2C2())
+			doHeartbeat();
+# endif
+	for(i=0; i<LCD_XFER_SLOTS; i++)
+		dev->xfer[i].u8_status = I2C_XFER_DONE;
+	dev->xhead = 0;
+#endif
+	
+	if(LCD_MCP(dev)) {
+		reset_values(dev);
+		mcp_setup(dev);
+	} else if(LCD_IFACE(dev) & lcd_spi) {
+		reset_values(dev);
+		spi_setup(dev);
+	}
+#ifdef LCD_GPIO
+	if(LCD_IFACE(dev) == lcd_gpio)
+		gpio_setup(dev);
+#endif
+	
+	return 0;
 }
 
-int is_busy(lcd *dev)
+static void init_wait(lcd *dev, uint16_t ticks)
 {
-    DELAY_US(lcd_setup_time2);
-    return 0;
-    
+#ifdef LCD_I2C_QUEUE
+	// a queued write starts the clock when it lands; make it this wait
+	dev->xticks[XFER_NEWEST(dev)] = ticks;
+#endif
+	dev->busy_start = LCD_TMR;
+	dev->busy_ticks = ticks;
+}
+
+/*
+ Polling the busy flag costs a fixed amount of bus time, so it only pays
+ off while more than that much of the expected execution time is left
+ (e.g. clear/home). Otherwise just let the timer run out.
+*/
+static int is_busy(lcd *dev)
+{
+	uint16_t start, elapsed;
 	uint8_t busy;
+	// what the caller is about to send; init steps and polls go through these
+	uint8_t data = dev->data, rs = dev->rs, rw = dev->rw;
+	
+	if((dev->init_state & INIT_STEP) != INIT_DONE
+			&& !(dev->init_state & INIT_ACTIVE)) {
+		lcd_init_step(dev);	// finish init first
+		dev->data = data;
+		dev->rs = rs;
+		dev->rw = rw;
+		return 1;
+	}
+	if(lcd_ready(dev))
+		return 0;
+	if(xfer_pending(dev))	// short writes can queue up behind each other
+		return !xfer_follows(dev);
+	
+	elapsed = computeDeltaTicks(dev->busy_start, LCD_TMR, LCD_TMR_PR);
+	if(elapsed >= dev->busy_ticks || !MASK_RW(dev))
+		return !lcd_ready(dev);
+	if(dev->busy_ticks - elapsed <= dev->poll_ticks)
+		return 1;
+	
+	start = LCD_TMR;
 	read_busy_addr(dev, &busy, NULL);
-	return (int)busy;
+	dev->poll_ticks = computeDeltaTicks(start, LCD_TMR, LCD_TMR_PR);
+	dev->data = data;
+	dev->rs = rs;
+	dev->rw = rw;
+	
+	if(!busy)
+		dev->busy_ticks = 0;
+	return !lcd_ready(dev);
 }
 
-static int is_map_valid(uint8_t mode, lcd_map map)
+/*
+ True if the controller is already in 4 bit mode and in nibble step with
+ us: two DDRAM addresses set are read back intact. One left in 8 bit mode
+ or half way through a byte by the reset garbles at least one of them.
+*/
+static int is_configured(lcd *dev)
 {
-	if(mode == LCD_8BIT) {
-		return 0;	// GPIO only, so individually check against a list of pins
+	uint8_t probe[2], busy, addr;
+	int i;
 	
-	} else {	// we need pins 0-7 assigned
+	// no reads with both E up, or without an RW pin to make them
+	if(dev->geom.dual || !MASK_RW(dev))
+		return 0;
+	
+	probe[0] = dev->max_addr;
+	probe[1] = 0x00;
+	for(i=0; i<2; i++) {
+		set_ddram_addr(dev, probe[i]);
+		while(is_busy(dev));
+		read_busy_addr(dev, &busy, &addr);
+		if(busy || addr != probe[i])
+			return 0;
+	}
+	
+	return 1;
+}
+
+#ifndef LCD_FIXED
+static int is_map_valid(uint8_t mode, lcd_map map)
+{
+	if(mode == LCD_8BIT) {	// MCP23017: GPB0-7 in order, control on GPA
+		uint8_t pins[5] = {map.rs, map.e, map.rw, map.v0, 0xFF};
 		size_t assignments[8] = {0};
-		assignments[map.d4] += 1;
-		assignments[map.d5] += 1;
-		assignments[map.d6] += 1;
-		assignments[map.d7] += 1;
-		assignments[map.rs] += 1;
-		assignments[map.rw] += 1;
-		assignments[map.e] += 1;
-		assignments[map.v0] += 1;
+		int i;
+#ifdef LCD_DUAL
+		pins[4] = map.e2;
+#endif
 		
+		if(map.d0 != 8 || map.d1 != 9 || map.d2 != 10 || map.d3 != 11
+				|| map.d4 != 12 || map.d5 != 13 || map.d6 != 14 || map.d7 != 15)
+			return 0;
+		for(i=0; i<5; i++) {
+			if(i >= 2 && pins[i] == 0xFF)
+				continue;
+			if(pins[i] > 7 || assignments[pins[i]]++)
+				return 0;
+		}
+		
+		return 1;
+	
+	} else {	// data, rs and e need pins; rw, v0 and e2 may be 0xFF
+		uint8_t pins[9] = {
+			map.d4, map.d5, map.d6, map.d7, map.rs, map.e,
+			map.rw, map.v0, 0xFF
+		};
+		size_t assignments[8] = {0};
 		int i;
-		for(i=0; i<8; i++) if(assignments[i] != 1) return 0;
+#ifdef LCD_DUAL
+		pins[8] = map.e2;
+#endif
+		
+		for(i=0; i<9; i++) {
+			if(i >= 6 && pins[i] == 0xFF)
+				continue;
+			if(pins[i] > 7 || assignments[pins[i]]++)
+				return 0;
+		}
 		
 		return 1;
 	}
 }
+#endif
 
 static void map_message(lcd *dev, message *msg)
 {
-	msg->part1 = 0x00;
-	msg->part2 = 0x00;
-	
-	if(dev->data & 0x80)
-		msg->part1 |= 0x01 << dev->map.d7;
-	if(dev->data & 0x40)
-		msg->part1 |= 0x01 << dev->map.d6;
-	if(dev->data & 0x20)
-		msg->part1 |= 0x01 << dev->map.d5;
-	if(dev->data & 0x10)
-		msg->part1 |= 0x01 << dev->map.d4;
-	if(dev->data & 0x08)
-		msg->part2 |= 0x01 << dev->map.d7;
-	if(dev->data & 0x04)
-		msg->part2 |= 0x01 << dev->map.d6;
-	if(dev->data & 0x02)
-		msg->part2 |= 0x01 << dev->map.d5;
-	if(dev->data & 0x01)
-		msg->part2 |= 0x01 << dev->map.d4;
-	
-	if(dev->rs) {
-		msg->part1 |= 0x01 << dev->map.rs;
-		msg->part2 |= 0x01 << dev->map.rs;
-	}
-	if(dev->rw) {
-		msg->part1 |= 0x01 << dev->map.rw;
-		msg->part2 |= 0x01 << dev->map.rw;
-	}
+	uint8_t ctrl = ctrl_bits(dev);
 	
-	if(dev->config & LCD_BACKLIGHT) {
-		msg->part1 |= 0x01 << dev->map.v0;
-		msg->part2 |= 0x01 << dev->map.v0;
-	}
+	msg->part1 = NIB_OUT(dev, dev->data >> 4) | ctrl;
+	msg->part2 = NIB_OUT(dev, dev->data & 0x0F) | ctrl;
     
 //printf("Message: 0x%02x\tpart1: 0x%02x\tpart2: 0x%02x\n", dev->data, msg->part1, msg->part2);
 }
 
+/*
+ Puts an MCP23017 in byte mode, so one transaction streams OLATA, OLATB,
+ OLATA..., with both ports driving and control idle.
+*/
+static void mcp_setup(lcd *dev)
+{
+	mcp_write(dev, MCP_IOCON, MCP_IOCON_SEQOP);
+	mcp_write(dev, MCP_OLATA, ctrl_bits(dev));
+	mcp_write(dev, MCP_IODIRA, 0x00);
+	mcp_write(dev, MCP_IODIRB, 0x00);
+}
+
+static void mcp_write(lcd *dev, uint8_t reg, uint8_t data)
+{
+	uint8_t buf[2];
+	if(LCD_IFACE(dev) & lcd_spi) {
+		if(reg == S08_OLAT)
+			dev->port = data;
+		spi_write(dev, reg, &data, 1);
+		return;
+	}
+	buf[0] = reg;
+	buf[1] = data;
+	send_bytes(dev, buf, 2);
+}
+
+/*
+ Contrast and power are in the extended instruction set (IS = 1) of
+ lcd_st7032 controllers, on codes that otherwise set the CGRAM address or
+ shift, so the address counter copy is put back afterwards. setup also
+ starts the oscillator and voltage follower and leaves IS = 1 for the
+ function set that ends init.
+*/
+static void native_ext(lcd *dev, int setup)
+{
+	uint8_t fs = 0x30 | (dev->geom.two_line ? 0x08 : 0x00)
+				| (dev->config&LCD_FONT_5x11 ? 0x04 : 0x00);
+	uint8_t c = dev->contrast ? dev->contrast & 0x3F : LCD_NATIVE_CONTRAST;
+	uint8_t ac = dev->ac, ac_mode = dev->ac_mode;
+	uint8_t instr[5];
+	uint8_t cnt = 0, i;
+	
+	instr[cnt++] = fs | 0x01;	// IS = 1
+	if(setup)
+		instr[cnt++] = 0x14;	// 1/5 bias, oscillator ~380kHz
+	instr[cnt++] = 0x70 | (c & 0x0F);	// contrast C3-C0
+	instr[cnt++] = 0x50 | (LCD_NATIVE_BOOST ? 0x04 : 0x00)
+				| ((c >> 4) & 0x03);	// booster, contrast C5-C4
+	instr[cnt++] = setup ? 0x6C : fs;	// follower on; or back to IS = 0
+	
+	for(i=0; i<cnt; i++) {
+		reset_values(dev);
+		dev->data = instr[i];
+		command(dev);
+	}
+	dev->ac = ac;
+	dev->ac_mode = ac_mode;
+}
+
 static void unmap_message(lcd *dev, message msg)
 {
-	dev->data = 0x00;
-	dev->data |= ((msg.part1 >> dev->map.d7) & 0x01) << 7;
-	dev->data |= ((msg.part1 >> dev->map.d6) & 0x01) << 6;
-	dev->data |= ((msg.part1 >> dev->map.d5) & 0x01) << 5;
-	dev->data |= ((msg.part1 >> dev->map.d4) & 0x01) << 4;
-	dev->data |= ((msg.part2 >> dev->map.d7) & 0x01) << 3;
-	dev->data |= ((msg.part2 >> dev->map.d6) & 0x01) << 2;
-	dev->data |= ((msg.part2 >> dev->map.d5) & 0x01) << 1;
-	dev->data |= ((msg.part2 >> dev->map.d4) & 0x01);
-	
-	/*	these aren't needed when reading in values...
-	dev->rs = (msg.part1 >> dev->map.rs) & 0x01;
-	dev->rw = (msg.part1 >> dev->map.rw) & 0x01;
-	*/
+	dev->data = (NIB_IN(dev, msg.part1) << 4) | NIB_IN(dev, msg.part2);
 }
 
-static void read_4bit(lcd *dev, uint8_t *data)
+static void read_4bit(lcd *dev, uint8_t data, uint8_t *in)
 {
-	if(dev->interface == lcd_i2c1)
-		read1I2C1(dev->address, data);
-	else if(dev->interface == lcd_i2c2)
-		read1I2C2(dev->address, data);
+	// RW/RS settle with E low, then the LCD drives the nibble while E is high
+	uint8_t buf[2];
+	buf[0] = data & ~MASK_E(dev);
+	buf[1] = data | MASK_E(dev);
+	send_bytes(dev, buf, 2);
+	receive_byte(dev, in);
+}
+
+static void receive_byte(lcd *dev, uint8_t *data)
+{
+	if(LCD_IFACE(dev) == lcd_i2c1)
+		read1I2C1(LCD_ADDR(dev), data);
+	else if(LCD_IFACE(dev) == lcd_i2c2)
+		read1I2C2(LCD_ADDR(dev), data);
+	else if(dev->expander == lcd_74hc595)	// write only: report the latch
+		*data = dev->port;
+	else if(LCD_IFACE(dev) & lcd_spi) {
+		dev->cs(0);
+		spi_io(dev, S08_OPCODE | S08_READ | LCD_ADDR(dev));
+		spi_io(dev, S08_GPIO);
+		*data = spi_io(dev, 0xFF);
+		dev->cs(1);
+	}
 }
 
 static void write_4bit(lcd *dev, uint8_t data)
 {
-printf("write_4bit():\thex: 0x%02x\n", data);
-	data &= ~(dev->e);
-	send_byte(dev, data);
-	DELAY_US(lcd_enable_time1);
+#ifdef LCD_GPIO
+	if(LCD_IFACE(dev) == lcd_gpio) {	// unmapped nibble is in dev->data
+		gpio_xfer(dev, dev->data, 1);
+		return;
+	}
+#endif
+	// single nibble strobe; E is already low from the previous write
+	uint8_t buf[2];
+	buf[0] = data | MASK_E(dev);
+	buf[1] = data & ~MASK_E(dev);
+	send_bytes(dev, buf, 2);
+}
+
+/*
+ Streams cnt characters to DDRAM in one bus transaction. Each character is a
+ full 4 bit frame, and the two I2C byte times (~180us @ 100kHz) between the
+ last strobe of one character and the first of the next already exceed the
+ 37us write execution time, so no delays are needed inside the burst. SPI,
+ and I2C above ~440kHz, are quicker than that, so there each character
+ waits out the last. lcd_st7032 takes one byte per character after a
+ single control byte, so a row is one transaction while a byte on the bus
+ outlasts the write.
+*/
+static void write_burst(lcd *dev, uint8_t *data, uint8_t cnt)
+{
+	uint8_t buf[1 + LCD_MAX_BURST * LCD_4BIT_FRAME];
+	uint16_t len;
+	uint8_t ctrl = (dev->port & ~BUS_PINS(dev)) | MASK_RS(dev);	// data, write
+	uint8_t step = cnt;
+	message msg;
+	uint8_t i, j;
+	
+#ifdef LCD_GPIO
+	if(LCD_IFACE(dev) == lcd_gpio) {	// no frames to pack; just go byte by byte
+		for(i=0; i<cnt; i++)
+			write_to_ram(dev, data[i]);
+		return;
+	}
+#endif
 	
-	data |= dev->e;
-	send_byte(dev, data);
-	DELAY_US(lcd_enable_time1);
+	if(LCD_IFACE(dev) & lcd_spi)	// a frame is ~4us; pace every character
+		step = 1;
+	else if(!bus_paces(LCD_NATIVE(dev) ? 1 : 2))	// fast mode I2C
+		step = 1;
 	
-	data &= ~(dev->e);
-	send_byte(dev, data);
-	DELAY_US(lcd_enable_time2);
+	for(j=0; j<cnt; j+=step) {
+		len = 0;
+		if(LCD_NATIVE(dev)) {
+			buf[len++] = NATIVE_DATA;
+			for(i=j; i<j+step; i++)
+				buf[len++] = data[i];
+		} else if(dev->config&LCD_8BIT) {
+			buf[len++] = MCP_OLATA;
+			for(i=j; i<j+step; i++)
+				len += encode_8bit(dev, ctrl, data[i], buf+len);
+		} else {
+			for(i=j; i<j+step; i++) {
+				msg.part1 = NIB_OUT(dev, data[i] >> 4) | ctrl;
+				msg.part2 = NIB_OUT(dev, data[i] & 0x0F) | ctrl;
+				len += encode_4bit(dev, msg, buf+len);
+			}
+		}
+		
+		while(is_busy(dev));	// a busy flag poll reuses pend_ticks
+		dev->pend_ticks = lcd_data_ticks;
+		send_frames(dev, buf, len);
+	}
+	ac_step(dev, cnt);
+}
+
+/*
+ LCD_TMR ticks left of the controller's power on time, ticks. Without
+ lcd_power_on() the time since reset is unknown and all of it is left.
+*/
+static uint16_t power_on_ticks(uint16_t ticks)
+{
+	// LCD_TMR_IF means LCD_TMR wrapped, i.e. far longer than needed
+	if(!lcd_powered)
+		return ticks;
+	if(LCD_TMR_IF || LCD_TMR >= ticks)
+		return 0;
+	return ticks - LCD_TMR;
 }
 
 static void reset_values(lcd *dev)
@@ -894,21 +2277,279 @@ static void reset_values(lcd *dev)
 
 static void send_byte(lcd *dev, uint8_t data)
 {
-	if(dev->interface == lcd_i2c1)
-		write1I2C1(dev->address, data);
-	else if(dev->interface == lcd_i2c2)
-		write1I2C2(dev->address, data);
+	shadow_port(dev, &data, 1);
+	if(LCD_IFACE(dev) == lcd_i2c1)
+		write1I2C1(LCD_ADDR(dev), data);
+	else if(LCD_IFACE(dev) == lcd_i2c2)
+		write1I2C2(LCD_ADDR(dev), data);
+	else if(LCD_IFACE(dev) & lcd_spi)
+		spi_write(dev, S08_OLAT, &data, 1);
+}
+
+static void send_bytes(lcd *dev, uint8_t *buf, uint16_t cnt)
+{
+	shadow_port(dev, buf, cnt);
+	if(LCD_IFACE(dev) == lcd_i2c1)
+		writeNI2C1(LCD_ADDR(dev), buf, cnt);
+	else if(LCD_IFACE(dev) == lcd_i2c2)
+		writeNI2C2(LCD_ADDR(dev), buf, cnt);
+	else if(LCD_IFACE(dev) & lcd_spi)
+		spi_write(dev, S08_OLAT, buf, cnt);
+}
+
+/*
+ Sends encoded instruction/data frames and starts the execution clock once
+ they have landed. On a queued module this returns as soon as a slot of
+ the ring is free, and the clock is started from the I2C interrupt by
+ xfer_done().
+*/
+static void send_frames(lcd *dev, uint8_t *buf, uint16_t cnt)
+{
+#ifdef LCD_I2C_QUEUE
+	if(send_queued(dev, buf, cnt, dev->pend_ticks, xfer_done))
+		return;
+#endif
+	
+	send_bytes(dev, buf, cnt);
+	dev->busy_start = LCD_TMR;
+	dev->busy_ticks = dev->pend_ticks;
+}
+
+#ifdef LCD_I2C_QUEUE
+/*
+ Copies buf into the next slot of the write ring and queues it on the
+ device's interrupt driven I2C module, waiting only for the slot to be
+ free. done runs when it lands; NULL for writes that don't strobe E and
+ so mustn't touch the execution clock. Returns 0, having sent nothing,
+ when the device's module isn't interrupt driven.
+*/
+static int send_queued(lcd *dev, uint8_t *buf, uint16_t cnt, uint16_t ticks,
+					void (*done)(I2C_XFER*))
+{
+	void (*queue)(I2C_XFER*) = NULL;
+	I2C_XFER *xfer = &dev->xfer[dev->xhead];
+# ifdef I2C1_INTERRUPT
+	if(LCD_IFACE(dev) == lcd_i2c1)
+		queue = queueI2C1;
+# endif
+# ifdef I2C2_INTERRUPT
+	if(LCD_IFACE(dev) == lcd_i2c2)
+		queue = queueI2C2;
+# endif
+	if(!queue)
+		return 0;
+	
+	while(xfer->u8_status == I2C_XFER_PENDING)	// ring is full
+		doHeartbeat();
+	shadow_port(dev, buf, cnt);
+	memcpy(dev->xbuf[dev->xhead], buf, cnt);
+	dev->xticks[dev->xhead] = ticks;
+	xfer->u8_addr = LCD_ADDR(dev);
+	xfer->pu8_data = dev->xbuf[dev->xhead];
+	xfer->u16_cnt = cnt;
+	xfer->pfn_done = done;
+	xfer->pv_arg = dev;
+	dev->xhead = (dev->xhead + 1) % LCD_XFER_SLOTS;
+	queue(xfer);
+	return 1;
+}
+#endif
+
+/*
+ Keeps lcd.port in step with the expander's output latch: the last byte
+ written, or on an MCP23017 the last one to land on GPA, which in byte
+ mode is every other byte after the register.
+*/
+static void shadow_port(lcd *dev, uint8_t *buf, uint16_t cnt)
+{
+	if(LCD_MCP(dev)) {
+		if(cnt > 1 && buf[0] == MCP_OLATA)
+			dev->port = buf[(cnt - 2) | 0x01];
+	} else if(cnt)
+		dev->port = buf[cnt - 1];
+}
+
+static uint8_t spi_io(lcd *dev, uint8_t data)
+{
+#if (NUM_SPI_MODS >= 1)
+	if(LCD_IFACE(dev) == lcd_spi1)
+		return (uint8_t)ioMasterSPI1(data);
+#endif
+#if (NUM_SPI_MODS >= 2)
+	if(LCD_IFACE(dev) == lcd_spi2)
+		return (uint8_t)ioMasterSPI2(data);
+#endif
+	return 0xFF;
+}
+
+// writes with the SPI FIFO kept full; returns once the last byte is out
+static void spi_send(lcd *dev, uint8_t *buf, uint16_t cnt)
+{
+#if (NUM_SPI_MODS >= 1)
+	if(LCD_IFACE(dev) == lcd_spi1)
+		writeNSPI1(buf, cnt);
+#endif
+#if (NUM_SPI_MODS >= 2)
+	if(LCD_IFACE(dev) == lcd_spi2)
+		writeNSPI2(buf, cnt);
+#endif
+}
+
+/*
+ Expander outputs power up unknown, possibly with E high, so they are set
+ to idle before the reset sequence. The SPI module itself is configured by
+ the application (8 bit, mode 0, <= 10MHz), as the I2C one is.
+*/
+static void spi_setup(lcd *dev)
+{
+	uint8_t idle = ctrl_bits(dev);
+	// until HAEN is set the MCP23S08 only answers to A1:A0 = 00
+	uint8_t iocon[3] = {S08_OPCODE, S08_IOCON, S08_IOCON_SEQOP | S08_IOCON_HAEN};
+	
+	dev->cs(1);
+	if(dev->expander == lcd_mcp23s08) {
+		dev->cs(0);
+		spi_send(dev, iocon, 3);
+		dev->cs(1);
+		mcp_write(dev, S08_OLAT, idle);
+		mcp_write(dev, S08_IODIR, 0x00);
+	} else
+		send_bytes(dev, &idle, 1);
+}
+
+/*
+ Writes expander output states, one per byte, like writeNI2C1() does to a
+ PCF8574. A 74HC595 latches on the rising edge of RCLK, which is the chip
+ select, so it gets one select per byte and reg is ignored. An MCP23S08
+ takes the opcode and reg once, then every byte lands in reg. Either way E
+ stays up for a whole SPI byte, which covers its minimum pulse width.
+*/
+static void spi_write(lcd *dev, uint8_t reg, uint8_t *buf, uint16_t cnt)
+{
+	uint8_t head[2];
+	uint16_t i;
+	
+	if(dev->expander == lcd_74hc595) {
+		for(i=0; i<cnt; i++) {
+			dev->cs(0);
+			spi_send(dev, buf+i, 1);
+			dev->cs(1);
+		}
+		return;
+	}
+	
+	head[0] = S08_OPCODE | LCD_ADDR(dev);
+	head[1] = reg;
+	dev->cs(0);
+	spi_send(dev, head, 2);
+	spi_send(dev, buf, cnt);
+	dev->cs(1);
+}
+
+/*
+ A write may be queued behind one still on the bus if that one executes in
+ the data write time: the start, address and first frame bytes of the next
+ transaction take longer than that to reach the first E strobe, unless the
+ bus is very fast. Clear and home have to land and run out first.
+*/
+static int xfer_follows(lcd *dev)
+{
+#ifdef LCD_I2C_QUEUE
+	// stop, start, address and the first frame byte, at the least
+	return dev->xticks[XFER_NEWEST(dev)] <= lcd_data_ticks && bus_paces(3);
+#else
+	return 0;
+#endif
+}
+
+static int xfer_pending(lcd *dev)
+{
+#ifdef LCD_I2C_QUEUE
+	return dev->xfer[XFER_NEWEST(dev)].u8_status == I2C_XFER_PENDING;
+#else
+	return 0;
+#endif
+}
+
+#ifdef LCD_I2C_QUEUE
+static void xfer_done(I2C_XFER *xfer)
+{
+	lcd *dev = (lcd*)xfer->pv_arg;
+	dev->busy_start = LCD_TMR;
+	dev->busy_ticks = dev->xticks[xfer - dev->xfer];
+}
+#endif
+
+static void track_ac(lcd *dev, uint8_t rs, uint8_t instr)
+{
+	// mirror what the instruction just sent did to the address counter
+	if (rs)
+		ac_step(dev, 1);
+	else if (instr & 0x80) {
+		dev->ac = CTL_BIT(dev) | (instr & 0x7F);
+		dev->ac_mode &= ~AC_CGRAM;
+	} else if (instr & 0x40) {
+		dev->ac = CTL_BIT(dev) | (instr & 0x3F);
+		dev->ac_mode |= AC_CGRAM;
+	} else if (instr & 0x20) {
+		;	// function set
+	} else if (instr & 0x10) {
+		if (!(instr & 0x08)) {	// cursor move, not display shift
+			uint8_t mode = dev->ac_mode;
+			dev->ac_mode = (instr & 0x04) ? mode | AC_INC : mode & ~AC_INC;
+			ac_step(dev, 1);
+			dev->ac_mode = mode;
+		}
+	} else if (instr & 0x08) {
+		;	// display on/off
+	} else if (instr & 0x04) {
+		if (instr & 0x02)
+			dev->ac_mode |= AC_INC;
+		else
+			dev->ac_mode &= ~AC_INC;
+	} else if (instr & 0x03) {	// clear also sets increment mode
+		dev->ac = CTL_BIT(dev);
+		dev->ac_mode &= ~AC_CGRAM;
+		if (instr & 0x01)
+			dev->ac_mode |= AC_INC;
+	}
 }
 
 static void set_v0(lcd *dev, int status)
 {
-	uint8_t data;
-	read_4bit(dev, &data);
+	uint8_t buf[2];
+	uint8_t cnt = 0;
+	
+#ifdef LCD_GPIO
+	if(LCD_IFACE(dev) == lcd_gpio) {
+# ifdef LCD_GPIO_V0
+		GPIO_LAT(LCD_GPIO_V0) = status ? 1 : 0;
+# endif
+		return;
+	}
+#endif
+	
+	if(LCD_NATIVE(dev))	// the backlight isn't on the bus
+		return;
+	if(LCD_MCP(dev))
+		buf[cnt++] = MCP_OLATA;
+	// the shadow is the latch, so this is one write and no read
+	buf[cnt] = dev->port & ~MASK_V0(dev);
 	if(status)
-		data |= dev->v0;
-	else
-		data &= ~dev->v0;
-	send_byte(dev, data);	// doesn't toggle e like write_4bit; this is desired
+		buf[cnt] |= MASK_V0(dev);
+	cnt++;
+	
+#ifdef LCD_I2C_QUEUE
+	/*
+	 E isn't toggled, so this needn't wait for the LCD, only for a slot
+	 behind the writes already queued. It keeps the newest one's ticks for
+	 xfer_follows() and leaves the execution clock alone.
+	*/
+	if(send_queued(dev, buf, cnt, dev->xticks[XFER_NEWEST(dev)], NULL))
+		return;
+#endif
+	while(is_busy(dev));
+	send_bytes(dev, buf, cnt);	// doesn't toggle e like write_4bit; this is desired
 }
 
 
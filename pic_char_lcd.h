@@ -21,6 +21,12 @@
 
 #include <stdlib.h>
 
+// LCD writes on an I2C module built with I2Cx_INTERRUPT return once queued
+#if defined(I2C1_INTERRUPT) || defined(I2C2_INTERRUPT)
+#define LCD_I2C_QUEUE
+#include "pic24_i2c.h"
+#endif
+
 
 /*		CONFIGURATION FLAGS		*/
 // entry mode
@@ -52,6 +58,135 @@
 						| LCD_BACKLIGHT
 
 
+// percent added to the datasheet execution times before the next instruction
+#ifndef LCD_EXEC_MARGIN
+#define LCD_EXEC_MARGIN	10
+#endif
+
+// free-running timer used to track when the controller will be ready; if it's
+// already running lcd_init() needs PR at 0xFFFF and 50ms to fit in 16 bits
+#ifndef LCD_TMR
+#define LCD_TMR			TMR3
+#define LCD_TMR_PR		PR3
+#define LCD_TMR_CON		T3CON
+#define LCD_TMR_CONbits	T3CONbits
+#define LCD_TMR_CONFIG	(T3_ON | T3_IDLE_CON | T3_GATE_OFF | T3_PS_1_64 \
+						| T3_SOURCE_INT)
+#define LCD_TMR_IF		_T3IF
+#elif !defined(LCD_TMR_IF)
+#error "LCD_TMR also needs LCD_TMR_IF, the overriding timer's interrupt flag"
+#endif
+
+// most characters lcd_write() will pack into a single bus transaction
+#ifndef LCD_MAX_BURST
+#define LCD_MAX_BURST	20
+#endif
+// expander writes needed to clock one byte in 4 bit mode
+#define LCD_4BIT_FRAME	4
+
+// queued writes one display can have in flight before the next call blocks
+#ifndef LCD_XFER_SLOTS
+#define LCD_XFER_SLOTS	4
+#endif
+
+
+/*
+ Power up settings of controllers with a native I2C interface (lcd_st7032):
+ contrast 0-63 until lcd_set_contrast(), and whether to run the booster,
+ which these need below ~4.5V, i.e. on a 3.3V dsPIC33 board.
+*/
+#ifndef LCD_NATIVE_CONTRAST
+#define LCD_NATIVE_CONTRAST	0x20
+#endif
+#ifndef LCD_NATIVE_BOOST
+#define LCD_NATIVE_BOOST	1
+#endif
+// lcd.contrast for a level 0-63 set before lcd_init(); 0 there means
+// LCD_NATIVE_CONTRAST, so a real 0 needs LCD_CONTRAST(0)
+#define LCD_CONTRAST_SET	0x40
+#define LCD_CONTRAST(level)	(LCD_CONTRAST_SET | (level))
+
+
+// bus speed and per transaction software overhead used to plan lcd_flush()
+#ifndef LCD_BUS_KHZ
+#define LCD_BUS_KHZ			100
+#endif
+#ifndef LCD_XFER_OVERHEAD_US
+#define LCD_XFER_OVERHEAD_US	20
+#endif
+
+// DDRAM cells of one controller in every line mode
+#define LCD_DDRAM_SIZE	80
+
+/*
+ Define LCD_DUAL to drive 40x4 modules, which are two controllers sharing
+ everything but E; lcd_map.e2 is the second E. The bottom controller's
+ DDRAM is addressed with bit 7 set, so the driver sees 0x00-0xE7.
+*/
+// size of the buffers given to lcd_attach_fb()
+#ifdef LCD_DUAL
+#define LCD_FB_SIZE		(LCD_DDRAM_SIZE * 2)
+#else
+#define LCD_FB_SIZE		LCD_DDRAM_SIZE
+#endif
+
+
+/*
+ Builds driving a single known display can define LCD_FIXED to pin the bus,
+ address, geometry and expander pin map at compile time. lcd_init() then
+ fills those lcd fields in itself, and the bus dispatch, pin encoding and
+ geometry math fold to constants.
+*/
+#ifdef LCD_FIXED
+#ifndef LCD_FIXED_BUS
+#define LCD_FIXED_BUS		1	// 1 = lcd_i2c1, 2 = lcd_i2c2
+#endif
+#ifndef LCD_FIXED_ADDRESS
+#define LCD_FIXED_ADDRESS	(0x27<<1)
+#endif
+#ifndef LCD_FIXED_LINES
+#define LCD_FIXED_LINES		2
+#endif
+#ifndef LCD_FIXED_COLUMNS
+#define LCD_FIXED_COLUMNS	16
+#endif
+// expander pins, defaulting to the common PCF8574 backpack wiring
+#ifndef LCD_PIN_RS
+#define LCD_PIN_RS	0
+#define LCD_PIN_RW	1
+#define LCD_PIN_E	2
+#define LCD_PIN_V0	3
+#define LCD_PIN_D4	4
+#define LCD_PIN_D5	5
+#define LCD_PIN_D6	6
+#define LCD_PIN_D7	7
+#endif
+#ifdef LCD_DUAL
+#error "LCD_DUAL needs the run time pin map; it can't be used with LCD_FIXED"
+#endif
+// a fixed build is always a PCF8574 backpack in 4 bit mode
+#endif
+
+
+/*
+ Define LCD_GPIO to drive a display straight from MCU pins as lcd_gpio.
+ Pins are named as in pic24_ports.h, e.g. B5 for RB5. RS, E and D4-D7 are
+ needed, and with D0-D3 too the bus runs in 8 bit mode. RW and V0 may be
+ left out; without RW nothing is read and busy is tracked by the timer.
+ Define LCD_GPIO_5V for 5V modules, which allow about half the E timing.
+*/
+#ifdef LCD_GPIO
+#if !defined(LCD_GPIO_RS) || !defined(LCD_GPIO_E) || !defined(LCD_GPIO_D4) \
+		|| !defined(LCD_GPIO_D5) || !defined(LCD_GPIO_D6) \
+		|| !defined(LCD_GPIO_D7)
+#error "LCD_GPIO needs LCD_GPIO_RS, LCD_GPIO_E and LCD_GPIO_D4-D7"
+#endif
+#ifdef LCD_DUAL
+#error "LCD_DUAL needs a second E, which LCD_GPIO doesn't have"
+#endif
+#endif
+
+
 // from 0x20 - 0x7D, char encoding is ascii, which represents most use cases
 #define LCD_RIGHT_ARROW	0x7E
 #define LCD_LEFT_ARROW	0x7F
@@ -67,13 +202,24 @@ typedef enum lcd_interface
 {
 	lcd_i2c1=1,
 	lcd_i2c2=2,
-	lcd_i2c=3	// don't set to this value; only for bitmasking
-	/*
-	lcd_spi,
-	lcd_gpio
-	*/
+	lcd_i2c=3,	// don't set to this value; only for bitmasking
+	lcd_spi1=4,
+	lcd_spi2=8,
+	lcd_spi=12,	// don't set to this value; only for bitmasking
+	lcd_gpio=16	// pins from LCD_GPIO_*; one per build
 } lcd_interface;
 
+// chip on the far side of the I2C address or SPI chip select
+typedef enum lcd_expander
+{
+	lcd_pcf8574=0,	// 8 bit port; LCD in 4 bit mode
+	lcd_mcp23017=1,	// 16 bit; data on GPB0-7 and control on GPA, 8 bit mode
+	lcd_74hc595=2,	// SPI shift register, RCLK on chip select; write only
+	lcd_mcp23s08=3,	// SPI twin of the PCF8574 port; address is A1:A0 << 1
+	lcd_st7032=4	// no expander: the controller speaks I2C (ST7032i, AiP31068)
+} lcd_expander;
+
+// expander pins; on an MCP23017 GPA0-7 are 0-7 and GPB0-7 are 8-15
 typedef struct lcd_map
 {
 	uint8_t d0;
@@ -88,27 +234,90 @@ typedef struct lcd_map
 	uint8_t rw;
 	uint8_t e;
 	uint8_t v0;	// pretty sure this is on the i2c expander...
+#ifdef LCD_DUAL
+	uint8_t e2;	// bottom controller's E on 40x4 modules
+#endif
 } lcd_map;
 
+typedef struct lcd_geometry
+{
+	uint8_t rows;
+	uint8_t cols;
+	uint8_t split;		// columns from here on continue at +0x40 (16x1)
+	uint8_t two_line;	// controller uses 2 line DDRAM addressing
+	uint8_t cells;		// rows x cols
+	uint8_t dual;		// rows 2-3 are on a second controller (40x4)
+	uint8_t row_addr[4];	// DDRAM address of column 0 of each row
+	uint8_t cell_addr[LCD_FB_SIZE];	// linear cell -> DDRAM address
+	uint8_t ac_cell[LCD_FB_SIZE];	// address counter order -> linear cell
+} lcd_geometry;
+
+#ifdef LCD_DUAL
+// what the driver tracks per controller, for the one not selected
+typedef struct lcd_ctl
+{
+	uint8_t e;
+	uint8_t ac;
+	uint8_t ac_mode;
+	uint16_t busy_start;
+	uint16_t busy_ticks;
+} lcd_ctl;
+#endif
+
 typedef struct lcd
 {
 	lcd_interface interface;
 	uint8_t address;
+	lcd_expander expander;
+	void (*cs)(uint8_t level);	// SPI only: drives chip select (0 = selected)
 	lcd_map map;
 	
 	uint8_t lines;
 	uint8_t columns;
 	uint8_t config;	// flags corresponding to various LCD settings
+	uint8_t contrast;	// lcd_st7032 only: LCD_CONTRAST(0-63), or 0 for the default
 
 	// user can read these, but not directly modify
+	lcd_geometry geom;	// built from lines x columns by lcd_init()
 	size_t max_addr;
 	uint8_t data;
 	uint8_t rs;
 	uint8_t rw;
+	uint8_t port;		// shadow of the expander's output latch (GPA on an MCP23017)
+	// the I2C interrupt sets these two when a queued write lands
+	volatile uint16_t busy_start;	// timer tick the last instruction was sent at
+	volatile uint16_t busy_ticks;	// ticks the last instruction needs to execute
+	uint16_t poll_ticks;	// measured bus cost of one busy flag read
+	uint16_t pend_ticks;	// execution ticks of the write being sent
+	uint8_t *fb;		// optional shadow of DDRAM, see lcd_attach_fb()
+	uint8_t *fb_sent;	// what the glass was last sent
+	uint8_t fb_addr;	// cursor address within fb
+	uint8_t fb_full;	// glass contents unknown; next flush sends everything
+	uint8_t frame;		// lcd_begin_frame() nesting depth
+	uint8_t ac;			// software copy of the address counter
+	uint8_t ac_mode;	// direction and RAM the address counter is in
+	uint8_t init_state;	// lcd_init_step() progress
+#ifdef LCD_DUAL
+	uint8_t ctl;		// controller selected: 0 for rows 0-1, 1 for rows 2-3
+	lcd_ctl other;		// state of the controller not selected
+#endif
+#ifdef LCD_I2C_QUEUE
+	// ring of writes on the interrupt driven path, drained in order
+	I2C_XFER xfer[LCD_XFER_SLOTS];
+	uint16_t xticks[LCD_XFER_SLOTS];	// execution ticks each one starts
+	uint8_t xbuf[LCD_XFER_SLOTS][1 + LCD_MAX_BURST * LCD_4BIT_FRAME];
+	uint8_t xhead;		// next slot to fill
+#endif
 	
+#ifndef LCD_FIXED
 	// to be used as a masking value rather than data; DO NOT modify
 	uint8_t e;
 	uint8_t v0;
+	uint8_t rs_mask;
+	uint8_t rw_mask;
+	uint8_t nib_out[16];	// data nibble -> expander data pins
+	uint8_t nib_in[256];	// expander byte -> data nibble
+#endif
 } lcd;
 
 
@@ -128,17 +337,29 @@ typedef struct lcd
 */
 
 // Display control functions
+void	lcd_attach_fb(lcd *dev, uint8_t *fb, uint8_t *sent);
+int		lcd_begin_frame(lcd *dev);
 void	lcd_clear(lcd *dev);
 uint8_t	lcd_current_addr(lcd *dev);
+int		lcd_end_frame(lcd *dev);
+int		lcd_flush(lcd *dev);
 void	lcd_home(lcd *dev);
 int		lcd_init(lcd *dev);
+int		lcd_init_all(lcd *devs[], size_t cnt);
+int		lcd_init_start(lcd *dev);
+int		lcd_init_step(lcd *dev);
 int		lcd_move_cursor(lcd *dev, uint8_t row, uint8_t col);
+void	lcd_power_on(void);
+int		lcd_ready(lcd *dev);
+int		lcd_reinit(lcd *dev);
 int		lcd_set_addr(lcd *dev, uint8_t addr);
+uint8_t	lcd_sync_addr(lcd *dev);
 
 int		lcd_is_backlight(lcd *dev);
 void	lcd_set_backlight(lcd *dev, int status);
 int		lcd_is_blink(lcd *dev);
 void	lcd_set_blink(lcd *dev, int status);
+int		lcd_set_contrast(lcd *dev, uint8_t level);
 int		lcd_is_cursor(lcd *dev);
 void	lcd_set_cursor(lcd *dev, int status);
 int		lcd_is_display(lcd *dev);
@@ -12,16 +12,19 @@ printf("Config clock, led, and I2C\n");
     configI2C1(100);            // kHz
 
 printf("Config lcd\n");
-    lcd r_dev;
+    lcd r_dev = {0};	// fields left out must not be stack garbage
 	lcd *dev = &r_dev;//(lcd*)malloc(26);
 if (!dev) printf("malloc failed :/\n");
 	dev->interface = lcd_i2c1;
+	dev->expander = lcd_pcf8574;
+	dev->cs = NULL;	// SPI only
 printf("sizeof(lcd): %d\tdev: %x\tinterface: %d\n", sizeof(lcd), dev, dev->interface);
 	dev->address = 0x27<<1;	// need to double check...
 	// let dev->map automatically be set to default
 	dev->lines = 2;
 	dev->columns = 16;
 	dev->config = LCD_DEFAULT_I2C | LCD_CURSOR | LCD_BLINK;
+	dev->contrast = 0;	// lcd_st7032 only; 0 for LCD_NATIVE_CONTRAST
 
 printf("Init lcd\n");
 	lcd_init(dev);
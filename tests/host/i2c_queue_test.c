@@ -0,0 +1,211 @@
+/*
+ Host test of the interrupt driven I2C1 queue, the LCD write ring that
+ sits on it and the framebuffer, run against the register level mock in this directory. From
+ the top of the tree:
+
+	gcc -DI2C1_INTERRUPT -Itests/host -Ilib/pic24/include -I. \
+		tests/host/i2c_queue_test.c tests/host/mock.c \
+		lib/pic24/src/pic24_i2c.c pic_char_lcd.c -o i2c_queue_test
+	./i2c_queue_test
+
+ The mock headers shadow the device and pic24 ones, so tests/host must come
+ first on the include path.
+*/
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "pic24_all.h"
+#include "pic_char_lcd.h"
+#include "mock.h"
+
+static I2C_XFER *done_order[4];
+static uint8_t done_cnt;
+
+static void record_done(I2C_XFER *p_xfer)
+{
+	done_order[done_cnt++] = p_xfer;
+}
+
+static void drain(void)
+{
+	while(!isIdleI2C1())
+		doHeartbeat();
+}
+
+static int pending(lcd *dev)
+{
+	int i, n = 0;
+
+	for(i=0; i<LCD_XFER_SLOTS; i++)
+		if(dev->xfer[i].u8_status == I2C_XFER_PENDING)
+			n++;
+	return n;
+}
+
+// transfers run in order, a NAK ends only its own, polled calls wait
+static void test_queue(void)
+{
+	uint8_t a[] = {0x01, 0x02}, b[] = {0xAA}, c[] = {0x03};
+	I2C_XFER xa = {MOCK_PCF_ADDR, a, 2, 0, record_done};
+	I2C_XFER xb = {0x40, b, 1, 0, record_done};	// nothing there
+	I2C_XFER xc = {MOCK_PCF_ADDR, c, 1, 0, record_done};
+	uint32_t t;
+
+	mock_reset();
+	assert(isIdleI2C1());
+	t = mock_time;
+	queueI2C1(&xa);
+	queueI2C1(&xb);
+	queueI2C1(&xc);
+	assert(mock_time - t < 10);	// no waiting on the bus
+	assert(!isIdleI2C1());
+	assert(xa.u8_status == I2C_XFER_PENDING && xc.u8_status == I2C_XFER_PENDING);
+
+	drain();
+	assert(done_cnt == 3);
+	assert(done_order[0] == &xa && done_order[1] == &xb && done_order[2] == &xc);
+	assert(xa.u8_status == I2C_XFER_DONE);
+	assert(xb.u8_status == I2C_XFER_NAK);
+	assert(xc.u8_status == I2C_XFER_DONE);
+	assert(mock_pcf_cnt == 3);
+	assert(!memcmp(mock_pcf_log, "\x01\x02\x03", 3));
+
+	done_cnt = 0;
+	queueI2C1(&xa);
+	write1I2C1(MOCK_PCF_ADDR, 0x08);	// lands after the queued one
+	assert(isIdleI2C1() && xa.u8_status == I2C_XFER_DONE && done_cnt == 1);
+	assert(mock_pcf_cnt == 6);
+	assert(!memcmp(mock_pcf_log + 3, "\x01\x02\x08", 3));
+}
+
+static void lcd_setup(lcd *dev)
+{
+	dev->interface = lcd_i2c1;
+	dev->address = MOCK_PCF_ADDR;
+	dev->expander = lcd_pcf8574;
+	dev->lines = 2;
+	dev->columns = 16;
+	dev->config = LCD_DEFAULT_I2C;
+}
+
+// lcd writes return with their frames still queued and land intact
+static void test_lcd(void)
+{
+	lcd dev = {0};
+	uint32_t t;
+	int i;
+
+	mock_reset();
+	lcd_setup(&dev);
+	assert(lcd_init(&dev) == 0);
+	drain();
+	assert(mock_lcd.four && mock_lcd.two_line);
+
+	lcd_write(&dev, "Hello", 5);
+	assert(!isIdleI2C1());
+	lcd_write(&dev, " world", 6);
+	assert(!isIdleI2C1());
+	assert(pending(&dev) >= 1);
+
+	// more single writes than slots: the ring wraps and blocks when full
+	lcd_move_cursor(&dev, 1, 0);
+	for(i=0; i<2*LCD_XFER_SLOTS; i++) {
+		lcd_write_byte(&dev, 'a' + i);
+		assert(pending(&dev) <= LCD_XFER_SLOTS);
+	}
+	drain();
+	mock_delay_us(100);
+	assert(!memcmp(mock_lcd.ddram, "Hello world", 11));
+	assert(!memcmp(mock_lcd.ddram + 0x40, "abcdefgh", 2*LCD_XFER_SLOTS));
+
+	// a write queued behind a clear must wait out the clear's 1.52ms
+	lcd_clear(&dev);
+	lcd_write(&dev, "x", 1);
+	drain();
+	mock_delay_us(100);
+	assert(mock_lcd.ddram[0] == 'x' && mock_lcd.ddram[1] == ' ');
+
+	// the backlight doesn't wait out the clear; nothing behind it runs early
+	lcd_clear(&dev);
+	t = mock_time;
+	lcd_set_backlight(&dev, 0);
+	assert(mock_time - t < 100);
+	lcd_write(&dev, "y", 1);
+	drain();
+	mock_delay_us(100);
+	assert(!(mock_pcf_latch & 0x08) && mock_lcd.ddram[0] == 'y');
+	lcd_set_backlight(&dev, 1);
+	drain();
+	assert(mock_pcf_latch & 0x08);
+	
+	printf("violations %d\n", mock_lcd.violations);
+	assert(mock_lcd.violations == 0);
+}
+
+// a flush sends only what changed, and nothing at all the second time
+static void test_flush(void)
+{
+	lcd dev = {0};
+	uint8_t fb[LCD_FB_SIZE], sent[LCD_FB_SIZE];
+	uint16_t cnt;
+	
+	mock_reset();
+	lcd_setup(&dev);
+	assert(lcd_init(&dev) == 0);
+	lcd_attach_fb(&dev, fb, sent);
+	lcd_write(&dev, "frame", 5);
+	assert(lcd_flush(&dev) > 0);
+	drain();
+	mock_delay_us(100);
+	assert(!memcmp(mock_lcd.ddram, "frame ", 6));
+	
+	cnt = mock_pcf_cnt;
+	assert(lcd_flush(&dev) == 0);
+	drain();
+	assert(mock_pcf_cnt == cnt);
+	
+	lcd_move_cursor(&dev, 1, 3);
+	lcd_write(&dev, "x", 1);
+	assert(lcd_flush(&dev) == 1);
+	drain();
+	mock_delay_us(100);
+	assert(mock_lcd.ddram[0x43] == 'x');
+	assert(mock_lcd.violations == 0);
+}
+
+// reads follow the visible layout across rows, with or without a framebuffer
+static void test_read(void)
+{
+	lcd dev = {0};
+	uint8_t fb[LCD_FB_SIZE], sent[LCD_FB_SIZE];
+	uint8_t text[33] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ012345";
+	uint8_t from_fb[32], from_glass[32];
+	
+	mock_reset();
+	lcd_setup(&dev);
+	assert(lcd_init(&dev) == 0);
+	lcd_attach_fb(&dev, fb, sent);
+	lcd_write(&dev, text, 32);
+	lcd_flush(&dev);
+	drain();
+	
+	lcd_move_cursor(&dev, 0, 0);
+	assert(lcd_read(&dev, from_fb, 32) == 32);
+	lcd_attach_fb(&dev, NULL, NULL);
+	lcd_move_cursor(&dev, 0, 0);
+	assert(lcd_read(&dev, from_glass, 32) == 32);
+	assert(!memcmp(from_fb, text, 32));
+	assert(!memcmp(from_glass, from_fb, 32));
+	assert(mock_lcd.violations == 0);
+}
+
+int main(void)
+{
+	configI2C1(400);
+	test_queue();
+	test_lcd();
+	test_flush();
+	test_read();
+	printf("ok\n");
+	return 0;
+}
@@ -0,0 +1,282 @@
+/*
+ Register level stand-in for the I2C1 module, Timer3 and a PCF8574 LCD
+ backpack. Time is counted in Timer3 ticks (FCY / 64) and moves on by one
+ at every SFR access, which is roughly what a polling loop costs on the
+ part. A start, stop or ACK takes one SCL period and a byte nine, from
+ I2C1BRG; when one finishes its bits clear, I2C1STAT is updated and
+ MI2C1IF is raised, and _MI2C1Interrupt() runs at the next access made
+ outside of it while MI2C1IE is set. Code that spins on RAM the ISR writes
+ would never get there, so a CPU time signal also ticks the clock while no
+ access is under way, as the peripheral runs alongside the core.
+*/
+#include <signal.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xc.h"
+#include "mock.h"
+#include "pic24_all.h"
+
+#define TRN_IDLE	0xFFFF	// nothing written to I2C1TRN
+
+enum { OP_NONE, OP_START, OP_STOP, OP_TX, OP_RX, OP_ACK };
+
+mock_i2ccon_t mock_i2c1con, mock_i2c2con;
+mock_i2cstat_t mock_i2c1stat, mock_i2c2stat;
+uint16_t mock_i2c1trn = TRN_IDLE, mock_i2c1rcv, mock_i2c1brg;
+uint16_t mock_i2c2trn, mock_i2c2rcv, mock_i2c2brg;
+uint8_t mock_mi2c1if, mock_mi2c1ie, mock_mi2c1ip;
+uint16_t mock_tmr3, mock_pr3 = 0xFFFF;
+mock_tcon_t mock_t3con;
+uint8_t mock_t3if, mock_swdten, mock_unused;
+const char *sz_lastTimeoutError;
+
+uint32_t mock_time;
+mock_hd44780 mock_lcd;
+uint8_t mock_pcf_latch = 0xFF;
+uint8_t mock_pcf_log[64];
+uint16_t mock_pcf_cnt;
+
+static uint8_t op;
+static uint32_t op_end;
+static uint8_t in_isr;
+static volatile sig_atomic_t in_sfr;
+static uint8_t bus_first;	// next byte is the address
+static uint8_t bus_ours;	// the PCF8574 ACKed its address
+static uint8_t bus_read;
+static uint8_t lcd_hi, lcd_have_hi, lcd_rd_hi, lcd_rdval;
+
+
+static void lcd_exec(uint8_t rs, uint8_t b)
+{
+	mock_hd44780 *c = &mock_lcd;
+	uint32_t us = 37;
+
+	if(mock_time < c->busy_until)
+		c->violations++;
+	if(rs) {
+		c->ddram[c->ac & 0x7F] = b;
+		c->ac = (c->ac + (c->inc ? 1 : -1)) & 0x7F;
+	} else if(b & 0x80)
+		c->ac = b & 0x7F;
+	else if(b & 0x40)
+		;	// CGRAM isn't modelled
+	else if(b & 0x20) {
+		c->four = !(b & 0x10);
+		c->two_line = !!(b & 0x08);
+	} else if(b & 0x04)
+		c->inc = !!(b & 0x02);
+	else if(b & 0x02) {
+		c->ac = 0;
+		us = 1520;
+	} else if(b & 0x01) {
+		memset(c->ddram, ' ', sizeof c->ddram);
+		c->ac = 0;
+		c->inc = 1;
+		us = 1520;
+	}
+	c->busy_until = mock_time + us * (FCY / 1000000) / 64;
+}
+
+// default backpack wiring: P0 RS, P1 RW, P2 E, P3 backlight, P4-P7 D4-D7
+static void pcf_write(uint8_t v)
+{
+	uint8_t e_old = mock_pcf_latch & 0x04, e_new = v & 0x04;
+	uint8_t rs = v & 0x01, rw = v & 0x02;
+
+	if(mock_pcf_cnt < sizeof mock_pcf_log)
+		mock_pcf_log[mock_pcf_cnt] = v;
+	mock_pcf_cnt++;
+	if(!e_old && e_new && rw && !lcd_rd_hi)
+		lcd_rdval = rs ? mock_lcd.ddram[mock_lcd.ac & 0x7F]
+				: (mock_time < mock_lcd.busy_until ? 0x80 : 0) | (mock_lcd.ac & 0x7F);
+	if(e_old && !e_new) {
+		if(rw) {
+			if(mock_lcd.four && !lcd_rd_hi)
+				lcd_rd_hi = 1;
+			else {
+				lcd_rd_hi = 0;
+				if(rs)
+					mock_lcd.ac = (mock_lcd.ac + (mock_lcd.inc ? 1 : -1)) & 0x7F;
+			}
+		} else if(!mock_lcd.four)
+			lcd_exec(rs, v & 0xF0);
+		else if(!lcd_have_hi) {
+			lcd_hi = v & 0xF0;
+			lcd_have_hi = 1;
+		} else {
+			lcd_have_hi = 0;
+			lcd_exec(rs, lcd_hi | (v >> 4));
+		}
+	}
+	mock_pcf_latch = v;
+}
+
+// quasi-bidirectional: pins written high read whatever the LCD drives
+static uint8_t pcf_read(void)
+{
+	uint8_t lcd = mock_pcf_latch;
+
+	if((mock_pcf_latch & 0x06) == 0x06)
+		lcd = lcd_rd_hi ? lcd_rdval << 4 : lcd_rdval;
+	return (mock_pcf_latch & 0x0F) | (lcd & mock_pcf_latch & 0xF0);
+}
+
+static void start_op(void)
+{
+	uint32_t bit = (mock_i2c1brg + 1u + 63) / 64;
+
+	if(mock_i2c1con.SEN || mock_i2c1con.RSEN)
+		op = OP_START;
+	else if(mock_i2c1con.PEN)
+		op = OP_STOP;
+	else if(mock_i2c1con.ACKEN)
+		op = OP_ACK;
+	else if(mock_i2c1con.RCEN) {
+		op = OP_RX;
+		bit *= 9;
+	} else if(mock_i2c1trn != TRN_IDLE) {
+		op = OP_TX;
+		mock_i2c1stat.TRSTAT = 1;
+		bit *= 9;
+	} else
+		return;
+	op_end = mock_time + bit;
+}
+
+static void finish_op(void)
+{
+	uint8_t b;
+
+	switch(op) {
+		case OP_START:
+			mock_i2c1con.SEN = 0;
+			mock_i2c1con.RSEN = 0;
+			bus_first = 1;
+			break;
+		case OP_STOP:
+			mock_i2c1con.PEN = 0;
+			bus_ours = 0;
+			break;
+		case OP_ACK:
+			mock_i2c1con.ACKEN = 0;
+			break;
+		case OP_RX:
+			mock_i2c1con.RCEN = 0;
+			mock_i2c1rcv = bus_ours ? pcf_read() : 0xFF;
+			mock_i2c1stat.RBF = 1;
+			break;
+		case OP_TX:
+			b = mock_i2c1trn;
+			mock_i2c1trn = TRN_IDLE;
+			mock_i2c1stat.TRSTAT = 0;
+			if(bus_first) {
+				bus_first = 0;
+				bus_ours = (b & 0xFE) == MOCK_PCF_ADDR;
+				bus_read = b & 0x01;
+			} else if(bus_ours && !bus_read)
+				pcf_write(b);
+			mock_i2c1stat.ACKSTAT = !bus_ours;
+			break;
+	}
+	op = OP_NONE;
+	mock_mi2c1if = 1;
+}
+
+void mock_sfr(void)
+{
+	in_sfr++;
+	mock_time++;
+	if(++mock_tmr3 == 0)
+		mock_t3if = 1;
+	if(op == OP_NONE)
+		start_op();
+	else if(mock_time >= op_end)
+		finish_op();
+	if(mock_mi2c1if && mock_mi2c1ie && !in_isr) {
+		in_isr = 1;
+		_MI2C1Interrupt();
+		in_isr = 0;
+	}
+	in_sfr--;
+}
+
+static void tick(int sig)
+{
+	if(!in_sfr)
+		mock_sfr();
+}
+
+uint16_t *mock_rcv(void)
+{
+	mock_sfr();
+	mock_i2c1stat.RBF = 0;
+	return &mock_i2c1rcv;
+}
+
+void mock_run(uint32_t ticks)
+{
+	while(ticks--)
+		mock_sfr();
+}
+
+void mock_reset(void)
+{
+	struct itimerval it = {{0, 20}, {0, 20}};
+
+	signal(SIGVTALRM, tick);
+	setitimer(ITIMER_VIRTUAL, &it, NULL);
+	memset(&mock_lcd, 0, sizeof mock_lcd);
+	mock_lcd.inc = 1;
+	mock_pcf_latch = 0xFF;
+	mock_pcf_cnt = 0;
+	lcd_have_hi = lcd_rd_hi = 0;
+}
+
+void mock_delay_us(uint32_t us)
+{
+	mock_run((us * (FCY / 1000000) + 63) / 64);
+}
+
+void doHeartbeat(void)
+{
+	mock_sfr();
+}
+
+// no SPI parts on this bus
+uint16_t ioMasterSPI1(uint16_t u16_c)
+{
+	reportError("SPI1 used");
+	return 0xFF;
+}
+
+void writeNSPI1(uint8_t *pu8_data, uint16_t u16_cnt)
+{
+	reportError("SPI1 used");
+}
+
+void reportError(const char *szErrorMessage)
+{
+	fprintf(stderr, "reportError: %s\n", szErrorMessage);
+	abort();
+}
+
+uint16_t getTimerPrescaleBits(uint8_t u8_TCKPS)
+{
+	static const uint16_t au16_pre[] = {1, 8, 64, 256};
+
+	return au16_pre[u8_TCKPS & 0x03];
+}
+
+uint16_t usToU16Ticks(uint16_t u16_us, uint16_t u16_pre)
+{
+	return (uint16_t)((double)u16_us * (FCY / 1000000) / u16_pre + 0.5);
+}
+
+uint16_t computeDeltaTicks(uint16_t u16_start, uint16_t u16_end, uint16_t u16_tmrPR)
+{
+	if(u16_end >= u16_start)
+		return u16_end - u16_start;
+	return u16_tmrPR - u16_start + u16_end + 1;
+}
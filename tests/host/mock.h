@@ -0,0 +1,32 @@
+/*
+ What the host test can see of the simulated bus: a PCF8574 backpack at
+ MOCK_PCF_ADDR with an HD44780 behind it. Any other address NAKs.
+*/
+#ifndef MOCK_H
+#define MOCK_H
+
+#include <stdint.h>
+
+#define MOCK_PCF_ADDR	0x4E
+
+typedef struct mock_hd44780
+{
+	uint8_t ddram[128];
+	uint8_t ac;
+	uint8_t four;		// function set has picked 4 bit mode
+	uint8_t two_line;
+	uint8_t inc;
+	uint32_t busy_until;	// mock_time the last instruction finishes
+	int violations;		// writes that landed while busy
+} mock_hd44780;
+
+extern uint32_t mock_time;		// LCD_TMR ticks since start, never wraps
+extern mock_hd44780 mock_lcd;
+extern uint8_t mock_pcf_latch;
+extern uint8_t mock_pcf_log[64];	// bytes written to the PCF8574, oldest first
+extern uint16_t mock_pcf_cnt;
+
+void mock_reset(void);	// also starts the clock ticking in the background
+void mock_run(uint32_t ticks);
+
+#endif
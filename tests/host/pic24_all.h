@@ -0,0 +1,26 @@
+// host build: what pic_char_lcd.c gets from pic24_all.h on the part
+#ifndef MOCK_PIC24_ALL_H
+#define MOCK_PIC24_ALL_H
+
+#include "pic24_chip.h"
+#include "pic24_clockfreq.h"
+#include "pic24_util.h"
+#include "pic24_i2c.h"
+#include "pic24_spi.h"
+
+#define T3_ON			0x8000
+#define T3_IDLE_CON		0x0000
+#define T3_GATE_OFF		0x0000
+#define T3_PS_1_64		0x0020
+#define T3_SOURCE_INT	0x0000
+
+#define getTimerPrescale(TxCONbits)	getTimerPrescaleBits(TxCONbits.TCKPS)
+uint16_t getTimerPrescaleBits(uint8_t u8_TCKPS);
+uint16_t usToU16Ticks(uint16_t u16_us, uint16_t u16_pre);
+uint16_t computeDeltaTicks(uint16_t u16_start, uint16_t u16_end, uint16_t u16_tmrPR);
+
+void mock_delay_us(uint32_t us);
+#define DELAY_US(us)	mock_delay_us(us)
+#define DELAY_MS(ms)	mock_delay_us((ms) * 1000UL)
+
+#endif
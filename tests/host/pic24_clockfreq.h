@@ -0,0 +1,7 @@
+// host build: 60 MIPS, as the dsPIC33EP boards run
+#ifndef MOCK_PIC24_CLOCKFREQ_H
+#define MOCK_PIC24_CLOCKFREQ_H
+
+#define FCY	60000000UL
+
+#endif
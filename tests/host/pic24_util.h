@@ -0,0 +1,13 @@
+// host build: the pic24_util.h calls the I2C engine and LCD driver make
+#ifndef MOCK_PIC24_UTIL_H
+#define MOCK_PIC24_UTIL_H
+
+#include "pic24_chip.h"
+
+#define _ISR	// after pic24_chip.h, which would swap in the XC16 attributes
+
+extern const char *sz_lastTimeoutError;
+void reportError(const char *szErrorMessage);
+void doHeartbeat(void);
+
+#endif
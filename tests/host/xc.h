@@ -0,0 +1,96 @@
+/*
+ Host stand-in for the XC16 device header, with only the SFRs the I2C
+ engine and the LCD driver touch. Every access goes through mock_sfr(),
+ which moves simulated time on, finishes bus operations that are due and
+ takes a pending MI2C1 interrupt. Polled spins and queued transfers then
+ interleave as they would on the part. See i2c_queue_test.c.
+*/
+#ifndef MOCK_XC_H
+#define MOCK_XC_H
+
+#include <stdint.h>
+
+typedef union {
+	struct {
+		unsigned SEN:1;
+		unsigned RSEN:1;
+		unsigned PEN:1;
+		unsigned RCEN:1;
+		unsigned ACKEN:1;
+		unsigned ACKDT:1;
+		unsigned :9;
+		unsigned I2CEN:1;
+	};
+	uint16_t w;
+} mock_i2ccon_t;
+
+typedef struct {
+	unsigned RBF:1;
+	unsigned TRSTAT:1;
+	unsigned ACKSTAT:1;
+} mock_i2cstat_t;
+
+typedef union {
+	struct {
+		unsigned :4;
+		unsigned TCKPS:2;
+		unsigned :9;
+		unsigned TON:1;
+	};
+	uint16_t w;
+} mock_tcon_t;
+
+extern mock_i2ccon_t mock_i2c1con, mock_i2c2con;
+extern mock_i2cstat_t mock_i2c1stat, mock_i2c2stat;
+extern uint16_t mock_i2c1trn, mock_i2c1rcv, mock_i2c1brg;
+extern uint16_t mock_i2c2trn, mock_i2c2rcv, mock_i2c2brg;
+extern uint8_t mock_mi2c1if, mock_mi2c1ie, mock_mi2c1ip;
+extern uint16_t mock_tmr3, mock_pr3;
+extern mock_tcon_t mock_t3con;
+extern uint8_t mock_t3if, mock_swdten, mock_unused;
+
+void mock_sfr(void);
+uint16_t *mock_rcv(void);
+void _MI2C1Interrupt(void);
+
+#define MOCK_SFR(x)		(*(mock_sfr(), &(x)))
+
+#define I2C1CONbits		MOCK_SFR(mock_i2c1con)
+#define I2C1CON			(mock_sfr(), mock_i2c1con.w)
+#define I2C1STATbits	MOCK_SFR(mock_i2c1stat)
+#define I2C1TRN			MOCK_SFR(mock_i2c1trn)
+#define I2C1RCV			(*mock_rcv())	// reading clears RBF
+#define I2C1BRG			mock_i2c1brg
+#define _MI2C1IF		MOCK_SFR(mock_mi2c1if)
+#define _MI2C1IE		MOCK_SFR(mock_mi2c1ie)
+#define _MI2C1IP		mock_mi2c1ip
+
+// I2C2 is there for the polled calls to link; the tests don't use it
+#define I2C2CONbits		mock_i2c2con
+#define I2C2CON			mock_i2c2con.w
+#define I2C2STATbits	mock_i2c2stat
+#define I2C2TRN			mock_i2c2trn
+#define I2C2RCV			mock_i2c2rcv
+#define I2C2BRG			mock_i2c2brg
+
+#define TMR3			MOCK_SFR(mock_tmr3)
+#define PR3				mock_pr3
+#define T3CON			mock_t3con.w
+#define T3CONbits		mock_t3con
+#define _T3IF			mock_t3if
+
+#define _SWDTEN			mock_swdten
+#define ClrWdt()		mock_sfr()
+#define Nop()			mock_sfr()
+#define _PERSISTENT
+
+// what pic24_chip.h sizes the build from
+#define _U1RXIF			mock_unused
+#define _SI2C2IF		mock_unused
+#define _SPI1IF			mock_unused
+#define DEV_ID			0
+#define DEV_ID_STR		"host"
+#define EXPECTED_REVISION1		0
+#define EXPECTED_REVISION1_STR	"host"
+
+#endif